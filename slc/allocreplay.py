@@ -0,0 +1,396 @@
+#!/usr/bin/env python3
+# Replays an allocation trace (alloc.log written by DEV builds) against
+# alternative allocator strategies on the 0x7000 byte compiler heap.
+# Reports peak heap, fragmentation, the largest free block and the cost
+# per operation, and can write a fragmentation heatmap per strategy.
+import bisect
+import sys
+import time
+from dataclasses import dataclass, field
+from typing import Dict, List, Optional, Tuple
+
+import argh
+
+from tracefile import read_alloc_trace
+
+HEAP_SIZE = 0x7000
+SMALL_LIMIT = 64
+HEATMAP_COLUMNS = 448  # 64 bytes per column
+
+# (allocate, block size, offset in the recorded run)
+Op = Tuple[bool, int, int]
+
+
+class Allocator:
+    name = ''
+
+    def __init__(self):
+        self.steps = 0  # Free list entries visited, comparable across strategies
+
+    # Returns the offset and the size of the block actually used
+    def allocate(self, size: int) -> Optional[Tuple[int, int]]:
+        raise NotImplementedError
+
+    def release(self, offset: int, size: int):
+        raise NotImplementedError
+
+    # Resize a block in place, like shrink() and extend() in memory.c.
+    # By default a smaller block is kept whole and a larger one is moved
+    def resize(self, offset: int, size: int, new_size: int) -> Optional[Tuple[int, int]]:
+        if new_size <= size:
+            return offset, size
+        self.release(offset, size)
+        return self.allocate(new_size)
+
+    def largest_free(self) -> int:
+        raise NotImplementedError
+
+
+class BestFit(Allocator):
+    """utils/memory.c: exact size bins for small blocks, an address ordered
+    best fit free list with coalescing for the rest"""
+    name = 'bestfit'
+
+    def __init__(self):
+        super().__init__()
+        self.top = 0
+        self.bins: Dict[int, List[int]] = {}
+        self.free: List[List[int]] = []  # [offset, size], address ordered
+
+    def pop_bin(self, size: int) -> Optional[int]:
+        stack = self.bins.get(size)
+        return stack.pop() if stack else None
+
+    def push_bin(self, offset: int, size: int):
+        self.bins.setdefault(size, []).append(offset)
+
+    def find_free_block(self, size: int) -> Optional[int]:
+        best, best_diff = -1, HEAP_SIZE
+        for i, (offset, block_size) in enumerate(self.free):
+            self.steps += 1
+            if block_size >= size:
+                diff = block_size - size
+                if (diff == 0 or diff >= 4) and diff < best_diff:
+                    best, best_diff = i, diff
+                    if diff == 0:
+                        break
+        if best < 0:
+            return None
+        offset = self.free[best][0]
+        if best_diff > 0:
+            self.free[best] = [offset + size, best_diff]
+        else:
+            del self.free[best]
+        return offset
+
+    def split_bin(self, size: int) -> Optional[int]:
+        for bin_size in range(size + 4, SMALL_LIMIT + 1, 2):
+            offset = self.pop_bin(bin_size)
+            if offset is not None:
+                self.push_bin(offset + size, bin_size - size)
+                return offset
+        return None
+
+    def allocate(self, size):
+        offset = self.pop_bin(size) if size <= SMALL_LIMIT else None
+        if offset is None:
+            offset = self.find_free_block(size)
+        if offset is None:
+            if self.top + size <= HEAP_SIZE:
+                offset = self.top
+                self.top += size
+            elif size <= SMALL_LIMIT:
+                offset = self.split_bin(size)
+        return None if offset is None else (offset, size)
+
+    def release(self, offset, size):
+        if offset + size == self.top:
+            self.top -= size
+        elif size <= SMALL_LIMIT:
+            self.push_bin(offset, size)
+        else:
+            self.insert_free_block(offset, size)
+
+    def resize(self, offset, size, new_size):
+        if new_size < size:
+            if size < new_size + 4:
+                return offset, size
+            self.insert_free_block(offset + new_size, size - new_size)
+            return offset, new_size
+        grow = new_size - size
+        end = offset + size
+        if end == self.top and self.top + grow <= HEAP_SIZE:
+            self.top += grow
+            return offset, new_size
+        i = bisect.bisect_left(self.free, [end, 0])
+        self.steps += i
+        if i < len(self.free) and self.free[i][0] == end:
+            rest = self.free[i][1] - grow
+            if rest == 0:
+                del self.free[i]
+                return offset, new_size
+            if rest >= 4:
+                self.free[i] = [end + grow, rest]
+                return offset, new_size
+        return super().resize(offset, size, new_size)
+
+    def insert_free_block(self, offset: int, size: int):
+        i = bisect.bisect_left(self.free, [offset, 0])
+        self.steps += i
+        if i < len(self.free) and offset + size == self.free[i][0]:
+            size += self.free[i][1]
+            del self.free[i]
+        if i > 0 and sum(self.free[i - 1]) == offset:
+            i -= 1
+            offset = self.free[i][0]
+            size += self.free[i][1]
+            del self.free[i]
+        if offset + size == self.top:
+            self.top = offset
+        else:
+            self.free.insert(i, [offset, size])
+
+    def largest_free(self):
+        sizes = [s for _, s in self.free] + [s for s, stack in self.bins.items() if stack]
+        return max(sizes + [HEAP_SIZE - self.top])
+
+
+class SizeClass(Allocator):
+    """Power of two size classes with one free stack each, no coalescing"""
+    name = 'sizeclass'
+
+    def __init__(self):
+        super().__init__()
+        self.top = 0
+        self.classes: Dict[int, List[int]] = {}
+
+    @staticmethod
+    def class_size(size: int) -> int:
+        res = 8
+        while res < size:
+            res <<= 1
+        return res
+
+    def allocate(self, size):
+        size = self.class_size(size)
+        stack = self.classes.get(size)
+        self.steps += 1
+        if stack:
+            return stack.pop(), size
+        if self.top + size > HEAP_SIZE:
+            return None
+        self.top += size
+        return self.top - size, size
+
+    def release(self, offset, size):
+        self.classes.setdefault(size, []).append(offset)
+
+    def largest_free(self):
+        sizes = [s for s, stack in self.classes.items() if stack]
+        return max(sizes + [HEAP_SIZE - self.top])
+
+
+class Buddy(Allocator):
+    """Binary buddy system.  The heap is not a power of two, so it starts
+    as the free blocks 0x4000, 0x2000 and 0x1000"""
+    name = 'buddy'
+    MIN_ORDER = 3
+    MAX_ORDER = 14
+
+    def __init__(self):
+        super().__init__()
+        self.free: Dict[int, set] = {order: set() for order in range(self.MIN_ORDER, self.MAX_ORDER + 1)}
+        offset = 0
+        for order in range(self.MAX_ORDER, self.MIN_ORDER - 1, -1):
+            if offset + (1 << order) <= HEAP_SIZE:
+                self.free[order].add(offset)
+                offset += 1 << order
+
+    def allocate(self, size):
+        order = self.MIN_ORDER
+        while (1 << order) < size:
+            order += 1
+        current = order
+        while current <= self.MAX_ORDER and not self.free[current]:
+            self.steps += 1
+            current += 1
+        if current > self.MAX_ORDER:
+            return None
+        offset = min(self.free[current])
+        self.free[current].remove(offset)
+        while current > order:
+            current -= 1
+            self.free[current].add(offset + (1 << current))
+        return offset, 1 << order
+
+    def release(self, offset, size):
+        order = size.bit_length() - 1
+        while order < self.MAX_ORDER:
+            self.steps += 1
+            buddy = offset ^ (1 << order)
+            if buddy not in self.free[order]:
+                break
+            self.free[order].remove(buddy)
+            offset = min(offset, buddy)
+            order += 1
+        self.free[order].add(offset)
+
+    def largest_free(self):
+        return max([1 << order for order, blocks in self.free.items() if blocks] + [0])
+
+
+class Arena(Allocator):
+    """Bump allocation.  Space is reclaimed only when the blocks at the top
+    have all been released, like the parser's node arena"""
+    name = 'arena'
+
+    def __init__(self):
+        super().__init__()
+        self.blocks: List[List[int]] = []  # [offset, size, released]
+
+    def top(self) -> int:
+        return sum(self.blocks[-1][:2]) if self.blocks else 0
+
+    def allocate(self, size):
+        offset = self.top()
+        self.steps += 1
+        if offset + size > HEAP_SIZE:
+            return None
+        self.blocks.append([offset, size, 0])
+        return offset, size
+
+    def release(self, offset, size):
+        i = bisect.bisect_left(self.blocks, [offset, 0, 0])
+        self.blocks[i][2] = 1
+        while self.blocks and self.blocks[-1][2]:
+            self.steps += 1
+            self.blocks.pop()
+
+    def largest_free(self):
+        return HEAP_SIZE - self.top()
+
+
+STRATEGIES = [BestFit, SizeClass, Buddy, Arena]
+
+
+@dataclass
+class Report:
+    name: str
+    ops: int = 0
+    failed: int = 0
+    first_failure: int = -1
+    peak_heap: int = 0  # Highest block end address
+    peak_live: int = 0  # Block bytes, including rounding
+    min_largest_free: int = HEAP_SIZE
+    max_fragmentation: float = 0.0
+    fragmentation_sum: float = 0.0
+    seconds: float = 0.0
+    steps: int = 0
+    trace_mismatches: int = 0
+    heatmap: List[List[float]] = field(default_factory=list)
+
+
+def occupancy(live: Dict[int, Tuple[int, int]]) -> List[float]:
+    column = HEAP_SIZE // HEATMAP_COLUMNS
+    res = [0.0] * HEATMAP_COLUMNS
+    for offset, size in live.values():
+        end = offset + size
+        while offset < end:
+            c = offset // column
+            n = min(end, (c + 1) * column) - offset
+            res[c] += n / column
+            offset += n
+    return res
+
+
+# shrink() and extend() in memory.c are recorded as a release followed by
+# an allocation of another size at the same offset
+def is_resize(trace: List[Op], i: int) -> bool:
+    if i + 1 >= len(trace):
+        return False
+    (is_alloc, size, recorded), (next_alloc, next_size, next_recorded) = trace[i], trace[i + 1]
+    return not is_alloc and next_alloc and next_recorded == recorded and next_size != size
+
+
+def replay(trace: List[Op], strategy, rows: int) -> Report:
+    allocator = strategy()
+    report = Report(allocator.name)
+    live: Dict[int, Tuple[int, int]] = {}  # recorded offset -> simulated block
+    live_bytes = 0
+    sample = max(1, len(trace) // rows)
+    resized = False
+    for i, (is_alloc, size, recorded) in enumerate(trace):
+        if resized:  # Second record of a resize, already replayed
+            resized = False
+            continue
+        resized = recorded in live and is_resize(trace, i)
+        start = time.perf_counter()
+        if resized:
+            old = live.pop(recorded)
+            live_bytes -= old[1]
+            block = allocator.resize(old[0], old[1], trace[i + 1][1])
+            is_alloc = True
+        elif is_alloc:
+            block = allocator.allocate(size)
+        elif recorded in live:
+            allocator.release(*live[recorded])
+        report.seconds += time.perf_counter() - start
+        report.ops += 2 if resized else 1
+        if is_alloc:
+            if block is None:
+                report.failed += 1
+                if report.first_failure < 0:
+                    report.first_failure = i
+            else:
+                if block[0] != recorded:
+                    report.trace_mismatches += 1
+                live[recorded] = block
+                live_bytes += block[1]
+                report.peak_heap = max(report.peak_heap, sum(block))
+        elif recorded in live:
+            live_bytes -= live.pop(recorded)[1]
+        report.peak_live = max(report.peak_live, live_bytes)
+        largest = allocator.largest_free()
+        free_bytes = HEAP_SIZE - live_bytes
+        fragmentation = 1.0 - largest / free_bytes if free_bytes else 0.0
+        report.min_largest_free = min(report.min_largest_free, largest)
+        report.max_fragmentation = max(report.max_fragmentation, fragmentation)
+        report.fragmentation_sum += fragmentation
+        if i % sample == 0:
+            report.heatmap.append(occupancy(live))
+    report.steps = allocator.steps
+    return report
+
+
+# Binary greymap, one row per sample in time, darker is more occupied
+def write_heatmap(filename: str, heatmap: List[List[float]]):
+    with open(filename, 'wb') as f:
+        f.write(f'P5\n{HEATMAP_COLUMNS} {len(heatmap)}\n255\n'.encode('ascii'))
+        for row in heatmap:
+            f.write(bytes(255 - min(255, int(x * 255)) for x in row))
+
+
+def main(trace: str = 'alloc.log', strategies: str = ','.join(s.name for s in STRATEGIES),
+         heatmap: str = '', rows: int = 256):
+    ops = read_alloc_trace(trace)
+    if not ops:
+        print(f'No operations in {trace}')
+        sys.exit(1)
+    selected = [s for s in STRATEGIES if s.name in strategies.split(',')]
+    print(f'{len(ops)} operations, heap 0x{HEAP_SIZE:X}')
+    print(f'{"strategy":<10}{"peak":>8}{"live":>8}{"minfree":>9}{"frag":>7}{"maxfrag":>9}'
+          f'{"ns/op":>8}{"steps/op":>10}  failures')
+    for strategy in selected:
+        r = replay(ops, strategy, rows)
+        failures = f'{r.failed} (first at op {r.first_failure})' if r.failed else '0'
+        if strategy is BestFit and r.trace_mismatches:
+            failures += f', {r.trace_mismatches} offsets differ from the trace'
+        print(f'{r.name:<10}{r.peak_heap:>8}{r.peak_live:>8}{r.min_largest_free:>9}'
+              f'{r.fragmentation_sum / r.ops:>7.2f}{r.max_fragmentation:>9.2f}'
+              f'{r.seconds * 1e9 / r.ops:>8.0f}{r.steps / r.ops:>10.2f}  {failures}')
+        if heatmap:
+            write_heatmap(f'{heatmap}-{r.name}.pgm', r.heatmap)
+
+
+if __name__ == '__main__':
+    argh.dispatch_command(main)
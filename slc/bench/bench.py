@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Compiles the benchmark corpus, runs every program in the Z80 emulator
+# and compares code size, T-states and peak stack depth with baseline.txt
+import os.path
+import shutil
+import subprocess as sp
+import sys
+import tempfile
+from typing import Dict, List
+
+import argh
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+CORPUS = [
+    '../examples/fib.sl', '../examples/func.sl', '../examples/struct.sl', '../examples/tetris.sl',
+    'sort.sl', 'memcpy.sl', 'particles.sl',
+]
+METRICS = ['size', 'tstates', 'stack']
+TSTATES_LIMIT = 400000000
+
+Result = Dict[str, str]
+
+
+def program_name(path: str) -> str:
+    return os.path.splitext(os.path.basename(path))[0]
+
+
+def run_program(slc: str, emu: str, path: str, workdir: str) -> Result:
+    # The compiler keeps at most 32 characters of the source name,
+    # so it is compiled from a local copy
+    name = program_name(path)
+    source = f'{name}.sl'
+    shutil.copy(os.path.join(BENCH_DIR, path), os.path.join(workdir, source))
+    compiled = sp.run([slc, source], cwd=workdir, stdout=sp.PIPE, stderr=sp.STDOUT, text=True)
+    if compiled.returncode != 0:
+        return {'exit': 'compile', 'error': compiled.stdout.strip()}
+    ran = sp.run([emu, '-t', str(TSTATES_LIMIT), '-g', f'{name}.gpu', 'out.bin'],
+                 cwd=workdir, stdout=sp.PIPE, stderr=sp.STDOUT, text=True)
+    res = {}
+    for line in ran.stdout.splitlines():
+        parts = line.split()
+        if len(parts) == 2:
+            res[parts[0]] = parts[1]
+    return res
+
+
+def read_baseline(filename: str) -> Dict[str, List[int]]:
+    res = {}
+    if os.path.exists(filename):
+        for line in open(filename).readlines():
+            parts = line.split()
+            if len(parts) == len(METRICS) + 1 and not line.startswith('#'):
+                res[parts[0]] = [int(x) for x in parts[1:]]
+    return res
+
+
+def write_baseline(filename: str, results: Dict[str, Result]):
+    with open(filename, 'w') as f:
+        f.write('# program ' + ' '.join(METRICS) + '\n')
+        for name, res in results.items():
+            if res.get('exit') == 'main':
+                f.write(name + ' ' + ' '.join(res[m] for m in METRICS) + '\n')
+
+
+def delta(value: int, base: int) -> str:
+    if base == 0 or value == base:
+        return ''
+    return f'{(value - base) * 100.0 / base:+.1f}%'
+
+
+def main(slc: str = 'slc', emu: str = 'z80emu', baseline: str = os.path.join(BENCH_DIR, 'baseline.txt'),
+         update: bool = False, strict: bool = False):
+    slc = os.path.abspath(slc) if os.path.exists(slc) else slc
+    emu = os.path.abspath(emu) if os.path.exists(emu) else emu
+    base = read_baseline(baseline)
+    results = {}
+    with tempfile.TemporaryDirectory() as workdir:
+        for path in CORPUS:
+            results[program_name(path)] = run_program(slc, emu, path, workdir)
+
+    failed = False
+    regressed = False
+    print(f'{"program":<12}' + ''.join(f'{m:>12}{"":>9}' for m in METRICS) + '  exit')
+    for name, res in results.items():
+        state = res.get('exit', 'unknown')
+        if state != 'main':
+            failed = True
+            print(f'{name:<12} {state} {res.get("error", "")}')
+            continue
+        line = f'{name:<12}'
+        for i, m in enumerate(METRICS):
+            value = int(res[m])
+            d = delta(value, base[name][i]) if name in base else 'new'
+            if name in base and value > base[name][i]:
+                regressed = True
+            line += f'{value:>12}{d:>9}'
+        print(line + '  ' + state)
+
+    if update:
+        write_baseline(baseline, results)
+        print(f'Baseline written to {baseline}')
+    if failed or (strict and regressed):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    argh.dispatch_command(main)
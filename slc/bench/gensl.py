@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# Generates synthetic .sl programs for compiler throughput measurements.
+# The programs are meant to be compiled, not run.
+import random
+from typing import List
+
+import argh
+
+OPERATORS = ['+', '-', '&', '|', '^']
+WORD_OPERATORS = ['+', '-']  # Bitwise operators are byte only
+CONDITIONS = ['<', '>', '<=', '>=', '=', '!=']
+
+
+class Generator:
+    def __init__(self, seed: int, expr_size: int, depth: int):
+        self.rng = random.Random(seed)
+        self.expr_size = expr_size
+        self.depth = depth
+        self.lines: List[str] = []
+        self.functions: List[List[str]] = []  # parameter types of the functions so far
+
+    def emit(self, indent: int, text: str):
+        self.lines.append('\t' * indent + text)
+
+    def expression(self, names: List[str], size: int, operators: List[str] = OPERATORS) -> str:
+        if size <= 1 or not names:
+            if names and self.rng.random() < 0.7:
+                return self.rng.choice(names)
+            return str(self.rng.randrange(256))
+        left = self.rng.randrange(1, size)
+        text = (self.expression(names, left, operators) + self.rng.choice(operators) +
+                self.expression(names, size - left, operators))
+        return f'({text})' if self.rng.random() < 0.3 else text
+
+    def call(self, bytes_: List[str], words: List[str]) -> str:
+        index = self.rng.randrange(len(self.functions))
+        args = []
+        for t in self.functions[index]:
+            pool = bytes_ if t == 'byte' else words
+            args.append(self.rng.choice(pool) if pool and self.rng.random() < 0.5 else str(self.rng.randrange(100)))
+        return f'f{index}({",".join(args)})'
+
+    def block(self, indent: int, depth: int, bytes_: List[str], words: List[str], statements: int):
+        for _ in range(statements):
+            kind = self.rng.random()
+            if depth > 0 and kind < 0.25:
+                a, b = self.rng.choice(bytes_), self.expression(bytes_, 2)
+                op = self.rng.choice(CONDITIONS)
+                self.emit(indent, f'if {a}{op}{b}' if self.rng.random() < 0.5 else f'while {a}{op}{b}')
+                self.block(indent + 1, depth - 1, bytes_, words, max(1, statements // 2))
+                self.emit(indent, 'end')
+            elif self.functions and kind < 0.4:
+                self.emit(indent, f'{self.rng.choice(bytes_)}={self.call(bytes_, words)}')
+            elif words and kind < 0.6:
+                self.emit(indent, f'{self.rng.choice(words)}={self.expression(bytes_ + words, self.expr_size, WORD_OPERATORS)}')
+            else:
+                self.emit(indent, f'{self.rng.choice(bytes_)}={self.expression(bytes_, self.expr_size)}')
+
+    def program(self, globals_: int, structs: int, functions: int, statements: int) -> str:
+        gbytes, gwords = [], []
+        for i in range(globals_):
+            kind = i % 3
+            if kind == 0:
+                self.emit(0, f'var byte g{i} = {self.rng.randrange(256)}')
+                gbytes.append(f'g{i}')
+            elif kind == 1:
+                self.emit(0, f'var word g{i}')
+                gwords.append(f'g{i}')
+            else:
+                self.emit(0, f'var array {self.rng.randrange(2, 16)} byte g{i}')
+                gbytes.append(f'g{i}[{self.rng.randrange(2)}]')
+        for i in range(structs):
+            self.emit(0, f'struct S{i}')
+            self.emit(1, 'var byte x')
+            self.emit(1, 'var word y')
+            self.emit(1, f'var array {self.rng.randrange(2, 8)} byte t')
+            self.emit(0, 'end')
+            self.emit(0, f'var S{i} s{i}')
+            gbytes += [f's{i}.x', f's{i}.t[1]']
+            gwords.append(f's{i}.y')
+        for i in range(functions):
+            params = [self.rng.choice(['byte', 'word']) for _ in range(self.rng.randrange(4))]
+            self.emit(0, f'fun f{i}(' + ', '.join(f'{t} p{k}' for k, t in enumerate(params)) + ')')
+            bytes_ = gbytes + [f'p{k}' for k, t in enumerate(params) if t == 'byte'] + ['v0', 'v1']
+            words = gwords + [f'p{k}' for k, t in enumerate(params) if t == 'word'] + ['w0']
+            self.emit(1, 'var byte v0')
+            self.emit(1, 'var byte v1')
+            self.emit(1, 'var word w0')
+            self.block(1, self.depth, bytes_, words, statements)
+            self.emit(1, f'return {self.expression(bytes_, self.expr_size)}')
+            self.emit(0, 'end')
+            self.functions.append(params)
+        self.emit(0, 'fun main()')
+        self.emit(1, 'var byte v0')
+        self.block(1, 0, ['v0'] + gbytes, gwords, statements)
+        self.emit(0, 'end')
+        return '\n'.join(self.lines) + '\n'
+
+
+def main(output: str = 'synthetic.sl', globals_: int = 20, structs: int = 4, functions: int = 8,
+         statements: int = 6, depth: int = 2, expr_size: int = 4, seed: int = 1):
+    text = Generator(seed, expr_size, depth).program(globals_, structs, functions, statements)
+    with open(output, 'w') as f:
+        f.write(text)
+
+
+if __name__ == '__main__':
+    argh.dispatch_command(main)
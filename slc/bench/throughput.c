@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "strhash.h"
+#include "memory.h"
+#include "lexer.h"
+#include "parser.h"
+#include "codegen.h"
+#include "dev.h"
+#include "trace.h"
+
+// Runs one compiler phase over a source file and reports its throughput.
+// The lexer, parser and code generator pull from each other, so a phase
+// is measured together with the phases it depends on:
+//   lex    tokens only
+//   parse  lexer + parser
+//   gen    lexer + parser + code generation (output is counted, not written)
+// The allocator cannot be reset within a process, hence one phase per run.
+
+StrHash* texts;
+char program_filename[32];
+
+const byte* src_ptr = 0;
+const byte* src_end = 0;
+
+static byte* source = 0;
+static size_t source_size = 0;
+static byte source_read = 0;
+
+static unsigned long token_count = 0;
+static unsigned long node_count = 0;
+static unsigned long output_size = 0;
+
+// The whole source is handed to the lexer as a single block
+byte src_fill()
+{
+	if (source_read || source_size == 0) return 0;
+	source_read = 1;
+	src_ptr = source;
+	src_end = source + source_size;
+	return *src_ptr++;
+}
+
+static byte load_source(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	source = (byte*)malloc(size > 0 ? size : 1);
+	source_size = (size > 0 ? fread(source, 1, size, f) : 0);
+	fclose(f);
+	return 1;
+}
+
+static unsigned long count_nodes(Node* node)
+{
+	unsigned long n = 0;
+	for (; node; node = node->sibling)
+		n += 1 + count_nodes(node->parameters) + count_nodes(node->child);
+	return n;
+}
+
+// Tokens are requested in order, with a short look back
+static byte counting_lex(word index, Token* t)
+{
+	if (!lex_get(index, t)) return 0;
+	if ((unsigned long)index + 1 > token_count) token_count = (unsigned long)index + 1;
+	return 1;
+}
+
+static Node* counting_parse()
+{
+	Node* node = p_parse();
+	if (node) node_count += count_nodes(node);
+	return node;
+}
+
+static byte counting_write(word offset, const byte* data, word length)
+{
+	(void)data;
+	if ((unsigned long)offset + length > output_size)
+		output_size = (unsigned long)offset + length;
+	return 1;
+}
+
+static void run_lex()
+{
+	Token t;
+	word index = 0;
+	while (counting_lex(index, &t)) ++index;
+}
+
+static void run_parse()
+{
+	Node* node;
+	while ((node = counting_parse()) != 0)
+		p_release(node);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		printf("Usage: slc_throughput lex|parse|gen <source>\n");
+		return 1;
+	}
+	const char* phase = argv[1];
+	if (strcmp(phase, "lex") != 0 && strcmp(phase, "parse") != 0 && strcmp(phase, "gen") != 0)
+	{
+		printf("Unknown phase: %s\n", phase);
+		return 1;
+	}
+	strncpy(program_filename, argv[2], sizeof(program_filename) - 1);
+	if (!load_source(argv[2]))
+	{
+		printf("Failed to open code file.\n");
+		return 1;
+	}
+
+	// Measure the compiler, not the DEV build trace files
+	trace_enable(0);
+	dev_init();
+	alloc_init();
+	texts = sh_init();
+	lex_init();
+	p_init(counting_lex);
+	gen_init();
+
+	clock_t start = clock();
+	if (strcmp(phase, "lex") == 0)
+		run_lex();
+	else if (strcmp(phase, "parse") == 0)
+		run_parse();
+	else
+		generate_code(counting_parse, counting_write);
+	clock_t end = clock();
+
+	gen_shut();
+	p_shut();
+	lex_shut();
+	sh_shut(texts);
+	dev_shut();
+	alloc_shut();
+	free(source);
+
+	printf("phase %s\n", phase);
+	printf("source %lu\n", (unsigned long)source_size);
+	printf("tokens %lu\n", token_count);
+	printf("nodes %lu\n", node_count);
+	printf("bytes %lu\n", output_size);
+	printf("seconds %.6f\n", (double)(end - start) / CLOCKS_PER_SEC);
+	printf("peak %d\n", get_max_allocated());
+	return 0;
+}
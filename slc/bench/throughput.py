@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# Compiles synthetic programs of growing size with slc_throughput and
+# reports tokens/s, nodes/s, emitted bytes/s and the peak heap per size.
+# Every phase includes the ones before it, so phase times are differences.
+import os.path
+import subprocess as sp
+import sys
+import tempfile
+from typing import Dict, Optional
+
+import argh
+
+from gensl import Generator
+
+PHASES = ['lex', 'parse', 'gen']
+SWEEPS = ['globals_', 'structs', 'functions', 'statements', 'depth', 'expr_size']
+
+Result = Dict[str, str]
+
+
+def run_phase(tool: str, phase: str, source: str, workdir: str, repeat: int) -> Result:
+    best: Optional[Result] = None
+    for _ in range(repeat):
+        ran = sp.run([tool, phase, source], cwd=workdir, stdout=sp.PIPE, stderr=sp.STDOUT, text=True)
+        if ran.returncode != 0:
+            return {'error': ' '.join(ran.stdout.split())}
+        res = {}
+        for line in ran.stdout.splitlines():
+            parts = line.split()
+            if len(parts) == 2:
+                res[parts[0]] = parts[1]
+        if best is None or float(res['seconds']) < float(best['seconds']):
+            best = res
+    return best
+
+
+def rate(count: str, seconds: float) -> str:
+    if seconds <= 0.0:
+        return '-'
+    return f'{int(count) / seconds:.0f}'
+
+
+def main(tool: str = 'slc_throughput', sweep: str = 'functions', sizes: str = '1,2,4,8,12',
+         globals_: int = 20, structs: int = 4, functions: int = 8, statements: int = 6,
+         depth: int = 2, expr_size: int = 4, seed: int = 1, repeat: int = 5):
+    if sweep not in SWEEPS:
+        print(f'Unknown sweep {sweep}, expected one of {", ".join(SWEEPS)}')
+        sys.exit(1)
+    tool = os.path.abspath(tool) if os.path.exists(tool) else tool
+    params = {'globals_': globals_, 'structs': structs, 'functions': functions,
+              'statements': statements, 'depth': depth, 'expr_size': expr_size}
+    failed = False
+    print(f'{sweep:>10}{"lines":>8}{"tokens":>8}{"nodes":>8}{"bytes":>8}'
+          f'{"tokens/s":>12}{"nodes/s":>12}{"bytes/s":>12}{"peak":>8}')
+    with tempfile.TemporaryDirectory() as workdir:
+        for size in [int(x) for x in sizes.split(',')]:
+            params[sweep] = size
+            gen = Generator(seed, params['expr_size'], params['depth'])
+            text = gen.program(params['globals_'], params['structs'], params['functions'], params['statements'])
+            # The compiler keeps at most 32 characters of the source name
+            source = 'synthetic.sl'
+            with open(os.path.join(workdir, source), 'w') as f:
+                f.write(text)
+            res = {p: run_phase(tool, p, source, workdir, repeat) for p in PHASES}
+            error = next((res[p]['error'] for p in PHASES if 'error' in res[p]), None)
+            lines = text.count('\n')
+            if error:
+                failed = True
+                print(f'{size:>10}{lines:>8}  {error}')
+                continue
+            seconds = {p: float(res[p]['seconds']) for p in PHASES}
+            gen_res = res['gen']
+            print(f'{size:>10}{lines:>8}{gen_res["tokens"]:>8}{gen_res["nodes"]:>8}{gen_res["bytes"]:>8}'
+                  f'{rate(gen_res["tokens"], seconds["lex"]):>12}'
+                  f'{rate(gen_res["nodes"], seconds["parse"] - seconds["lex"]):>12}'
+                  f'{rate(gen_res["bytes"], seconds["gen"] - seconds["parse"]):>12}'
+                  f'{gen_res["peak"]:>8}')
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    argh.dispatch_command(main)
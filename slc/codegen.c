@@ -2,6 +2,8 @@
 #include <parser.h>
 #include <vector.h>
 #include <strhash.h>
+#include <symtab.h>
+#include <stats.h>
 #include "optimizer.h"
 #include "services.h"
 
@@ -19,6 +21,8 @@ const char* INVALID_LOCATION = "Invalid location";
 const char* UNSUPPORTED = "Unsupported";
 const char* EXPECT_IMMED = "Expecting immediate";
 const char* INVALID_OPCODE = "Invalid opcode";
+const char* FAST_PARAMS = "Too many parameters for fast call";
+extern const char* OUT_OF_MEMORY;
 
 #define ERROR_RET(line, msg) { error=1; error_exit(line,msg,1); }
 #define ASSERT(x)
@@ -69,11 +73,13 @@ typedef struct field_
 	BaseType	type;
 	word		name;
 	word		length;
+	word		offset;		// From the start of the struct
 } Field;
 
 typedef struct struct_
 {
 	word	name;
+	word	size;
 	Vector* fields;
 } Struct;
 
@@ -97,6 +103,7 @@ typedef struct function_prototype_
 {
 	word		name;
 	BaseType	return_type;
+	byte		fastcall;	// Parameters passed in registers
 	Vector* parameters;
 } FunctionPrototype;
 
@@ -104,30 +111,54 @@ static byte error=0;
 static byte bounds_checker_active = 0;
 static Vector* structs;
 static Vector* variables;
-static Vector* knowns;
 static Vector* unknowns;
+#ifdef CODE_FILE
+static Relocations relocations;	// Only read by the host optimizer
+#endif
 static Vector* function_addresses;
 static Vector* function_prototypes;
+// Symbol tables, from name to index in the vectors above
+static SymTab* struct_names;
+static SymTab* variable_names;
+static SymTab* prototype_names;
+static SymTab* knowns;				// Name to address
+static word locals_start = 0;		// Index of the first variable of the current function
 static parse_node_func parse_node;
 static file_write_func raw_write=0;
 static word write_offset=0;
+
+// Output is appended to a block buffer and handed to raw_write one full block
+// at a time.  out_base is the output offset of out_block[0]
+#define OUTPUT_BLOCK 256
+static byte out_block[OUTPUT_BLOCK];
+static word out_base=0;
+static word out_used=0;
 static word function_end=0;
 static Node* function_node=0;
 
+// Stack frame of the current function.  Without locals the stack pointer
+// is not moved, and without parameters either IX is not needed at all
+#define FRAME_NONE	0
+#define FRAME_IX	1
+#define FRAME_FULL	2
+static byte frame_kind=FRAME_FULL;
+
 #ifdef DEV
 #include <stdio.h>
-FILE* line_offsets_file = 0;
+#include <trace.h>
+static Trace line_offsets;
 FILE* abs_addr_file = 0;
+void open_line_offsets()
+{
+	trace_open(&line_offsets, "line_offsets.log");
+}
 void close_line_offsets()
 {
-	if (line_offsets_file)
-		fclose(line_offsets_file);
+	trace_close(&line_offsets);
 }
 void write_offset_line(word line)
 {
-	if (!line_offsets_file)
-		line_offsets_file = fopen("line_offsets.log", "w");
-	fprintf(line_offsets_file,"%hx %hx\n",line,0x1000+write_offset);
+	trace_write(&line_offsets, line, 0x1000 + write_offset);
 }
 void close_abs_addr()
 {
@@ -141,23 +172,28 @@ void save_unknown_address(word addr)
 	fwrite(&addr,2,1,abs_addr_file);
 }
 #else
+void open_line_offsets() {}
 void write_offset_line(word line) {}
 void save_unknown_address(word addr) {}
 void close_abs_addr() {}
 void close_line_offsets() {}
 #endif
 
+static word statement_line = 0;	// For errors raised outside a node
+
+// Start the code of a source line
+void begin_line(word line)
+{
+	statement_line = line;
+	write_offset_line(line);
+}
 
 word get_known_address(word line, word name)
 {
-	word i=0,n=vector_size(knowns);
-	for (; i < n; ++i)
-	{
-		Address* a = (Address*)vector_access(knowns,i);
-		if (a->name==name)
-			return a->address + 0x1000; // Add OS size offset
-	}
-	char buf[32];
+	word address;
+	if (symtab_get(knowns, name, &address))
+		return address + 0x1000; // Add OS size offset
+	char buf[32] = "Label";	// Temporary labels have no text
 	sh_text(texts, buf,name);
 #ifdef DEV
 	strcat(buf," missing");
@@ -169,8 +205,27 @@ word get_known_address(word line, word name)
 
 void add_known_address(word name, word addr)
 {
-	Address known = { name,addr };
-	vector_push(knowns, &known);
+	if (!symtab_get(knowns, name, 0) && !symtab_set(knowns, name, addr))
+		ERROR_RET(statement_line, OUT_OF_MEMORY);
+}
+
+// Record the offset of an absolute address operand, so the
+// optimizer can move code and retarget it
+// A lost relocation would let the optimizer move code that is still
+// referenced, so running out of memory here is fatal
+void add_relocation(word offset)
+{
+#ifdef CODE_FILE
+	if (relocations.count == relocations.capacity)
+	{
+		word capacity = relocations.capacity ? (relocations.capacity << 1) : 256;
+		word* offsets = (word*)realloc(relocations.offsets, capacity * sizeof(word));
+		if (!offsets) ERROR_RET(statement_line, OUT_OF_MEMORY);
+		relocations.offsets = offsets;
+		relocations.capacity = capacity;
+	}
+	relocations.offsets[relocations.count++] = offset;
+#endif
 }
 
 // Add an unknown.  Later when the location of 'name' is known, 
@@ -178,13 +233,49 @@ void add_known_address(word name, word addr)
 void add_unknown_address(word name, word addr)
 {
 	Address unknown = { name,addr };
-	vector_push(unknowns, &unknown);
+	if (!vector_push(unknowns, &unknown))
+		ERROR_RET(statement_line, OUT_OF_MEMORY);
+	add_relocation(addr);
 }
 
 
+void flush_output()
+{
+	if (out_used > 0)
+		raw_write(out_base, out_block, out_used);
+	out_base += out_used;
+	out_used = 0;
+}
+
 void write(const byte* data, word len)
 {
-	write_offset += raw_write(write_offset, data, len);
+	write_offset += len;
+	while (len > 0)
+	{
+		if (out_used == OUTPUT_BLOCK) flush_output();
+		word n = OUTPUT_BLOCK - out_used;
+		if (n > len) n = len;
+		for (word i = 0; i < n; ++i)
+			out_block[out_used++] = *data++;
+		len -= n;
+	}
+}
+
+// Overwrite previously written output.  Patches to the resident block are
+// done in place, earlier blocks are patched through raw_write
+void patch_output(word offset, const byte* data, word len)
+{
+	if (offset < out_base)
+	{
+		word n = out_base - offset;
+		if (n > len) n = len;
+		raw_write(offset, data, n);
+		offset += n;
+		data += n;
+		len -= n;
+	}
+	for (word i = 0; i < len; ++i)
+		out_block[offset - out_base + i] = data[i];
 }
 
 #define WRITE(x) write(x,sizeof(x))
@@ -195,7 +286,19 @@ void ld_hl_immed(word address)
 	WRITE(cmd);
 }
 
-void write_byte(byte b) { write(&b, 1); }
+// Load HL with a variable address, absolute unless local
+void ld_hl_var_address(Variable* var)
+{
+	if (!var->type.local) add_relocation(write_offset + 1);
+	ld_hl_immed(var->address);
+}
+
+void write_byte(byte b)
+{
+	if (out_used == OUTPUT_BLOCK) flush_output();
+	out_block[out_used++] = b;
+	++write_offset;
+}
 #define MULTI_BYTE_CMD(name) write(name##_cmd,sizeof(name##_cmd))
 
 #define add_c	write_byte(0x81)
@@ -211,6 +314,7 @@ const byte lsh_hl_cmd[] = { 0xCB, 0x25, 0xCB, 0x14 };
 const byte push_ix_cmd[] = { 0xDD,0xE5 };
 #define push_ix		WRITE(push_ix_cmd)
 #define push_bc		write_byte(0xC5)
+#define push_de		write_byte(0xD5)
 #define pop_af		write_byte(0xF1)
 #define pop_hl		write_byte(0xE1)
 #define pop_bc		write_byte(0xC1)
@@ -225,7 +329,8 @@ const byte push_ix_cmd[] = { 0xDD,0xE5 };
 
 #define ld_mem_hl_a	write_byte(0x77)
 #define sub_a		write_byte(0x97)
-#define set_bc_hl	push_hl; pop_bc
+const byte set_bc_hl_cmd[] = { 0x44, 0x4D }; // LD B,H    LD C,L
+#define set_bc_hl MULTI_BYTE_CMD(set_bc_hl)
 #define ld_mem_hl_b write_byte(0x70)
 #define ld_mem_hl_c write_byte(0x71)
 #define inc_hl		write_byte(0x23)
@@ -233,15 +338,23 @@ const byte push_ix_cmd[] = { 0xDD,0xE5 };
 void ld_a_mem_ix(byte offset) { const byte cmd[] = {0xDD, 0x7E, offset}; WRITE(cmd); }
 void ld_h_mem_ix(byte offset) { const byte cmd[] = { 0xDD, 0x66, offset }; WRITE(cmd); }
 void ld_l_mem_ix(byte offset) { const byte cmd[] = { 0xDD, 0x6E, offset }; WRITE(cmd); }
-void ld_a_mem_immed(word addr) { const byte cmd[] = { 0x3A, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
-void ld_hl_mem_immed(word addr) { const byte cmd[] = { 0x2A, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
+void ld_b_mem_ix(byte offset) { const byte cmd[] = { 0xDD, 0x46, offset }; WRITE(cmd); }
+void ld_c_mem_ix(byte offset) { const byte cmd[] = { 0xDD, 0x4E, offset }; WRITE(cmd); }
+void ld_a_mem_immed(word addr) { add_relocation(write_offset + 1); const byte cmd[] = { 0x3A, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
+void ld_hl_mem_immed(word addr) { add_relocation(write_offset + 1); const byte cmd[] = { 0x2A, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
+void ld_bc_mem_immed(word addr) { add_relocation(write_offset + 2); const byte cmd[] = { 0xED, 0x4B, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
+void ld_mem_ix_a(byte offset) { const byte cmd[] = { 0xDD, 0x77, offset }; WRITE(cmd); }
+void ld_mem_ix_h(byte offset) { const byte cmd[] = { 0xDD, 0x74, offset }; WRITE(cmd); }
+void ld_mem_ix_l(byte offset) { const byte cmd[] = { 0xDD, 0x75, offset }; WRITE(cmd); }
+void ld_mem_immed_a(word addr) { add_relocation(write_offset + 1); const byte cmd[] = { 0x32, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
+void ld_mem_immed_hl(word addr) { add_relocation(write_offset + 1); const byte cmd[] = { 0x22, (addr & 0xFF), (addr >> 8) }; WRITE(cmd); }
 
 const byte sub_hl_bc_cmd[] = { 0xBF, 0xED, 0x42 };  //  Clear-carry,  SBC HL,BC
 #define sub_hl_bc MULTI_BYTE_CMD(sub_hl_bc)
 
 const byte ld_bc_mem_hl_cmd[] = { 0x4E, 0x23, 0x46 }; // LD C,(HL)   INC HL    LD B,(HL)
 #define ld_bc_mem_hl MULTI_BYTE_CMD(ld_bc_mem_hl)
-const byte set_hl_bc_cmd[] = { 0xC5, 0xE1 }; // PUSH BC    POP HL
+const byte set_hl_bc_cmd[] = { 0x60, 0x69 }; // LD H,B    LD L,C
 #define set_hl_bc MULTI_BYTE_CMD(set_hl_bc)
 const byte set_hl_a_cmd[] = { 0x6F, 0x26, 0x00 }; // LD L,A    LD H,#0
 #define set_hl_a MULTI_BYTE_CMD(set_hl_a)
@@ -249,19 +362,53 @@ const byte set_hl_a_cmd[] = { 0x6F, 0x26, 0x00 }; // LD L,A    LD H,#0
 #define set_e_a write_byte(0x5F)
 #define set_b_c write_byte(0x41)
 #define set_c_a write_byte(0x4F)
+#define set_a_c write_byte(0x79)
+#define set_e_c write_byte(0x59)
 #define set_l_a write_byte(0x6F)
 #define set_h_a write_byte(0x67)
 #define set_a_l write_byte(0x7D)
-const byte set_de_hl_cmd[] = { 0xE5, 0xD1 };
+#define set_a_e write_byte(0x7B)
+#define set_l_e write_byte(0x6B)
+#define ex_de_hl write_byte(0xEB)
+#define cp_e	write_byte(0xBB)
+#define cp_h	write_byte(0xBC)
+const byte set_de_hl_cmd[] = { 0x54, 0x5D }; // LD D,H    LD E,L
 #define set_de_hl MULTI_BYTE_CMD(set_de_hl)
+const byte set_de_bc_cmd[] = { 0x50, 0x59 }; // LD D,B    LD E,C
+#define set_de_bc MULTI_BYTE_CMD(set_de_bc)
 
 void set_a_immed(byte b) { byte cmd[] = { 0x3E, b }; WRITE(cmd); }
 void set_h_immed(byte b) { byte cmd[] = { 0x26, b }; WRITE(cmd); }
+void set_l_immed(byte b) { byte cmd[] = { 0x2E, b }; WRITE(cmd); }
 void set_d_immed(byte b) { byte cmd[] = { 0x16, b }; WRITE(cmd); }
 void set_b_immed(byte b) { byte cmd[] = { 0x06, b }; WRITE(cmd); }
 void set_bc_immed(word w) { byte cmd[] = { 0x01, (w & 0xFF), (w >> 8) }; WRITE(cmd); }
 void set_de_immed(word w) { byte cmd[] = { 0x11, (w & 0xFF), (w >> 8) }; WRITE(cmd); }
 void set_hl_immed(word w) { byte cmd[] = { 0x21, (w & 0xFF), (w >> 8) }; WRITE(cmd); }
+void alu_a_immed(byte opcode, byte b) { byte cmd[] = { opcode, b }; WRITE(cmd); }
+
+#define ADD_A_N	0xC6
+#define SUB_N	0xD6
+#define AND_N	0xE6
+#define OR_N	0xF6
+#define XOR_N	0xEE
+#define CP_N	0xFE
+#define inc_a	write_byte(0x3C)
+#define dec_a	write_byte(0x3D)
+#define cpl		write_byte(0x2F)
+#define xor_a	write_byte(0xAF)
+#define or_a	write_byte(0xB7)
+#define add_a_a	write_byte(0x87)
+#define add_a_l	write_byte(0x85)
+#define set_a_h	write_byte(0x7C)
+#define dec_hl	write_byte(0x2B)
+#define add_hl_hl	write_byte(0x29)
+const byte srl_a_cmd[] = { 0xCB, 0x3F };
+#define srl_a MULTI_BYTE_CMD(srl_a)
+const byte rsh_hl_cmd[] = { 0xCB, 0x3C, 0xCB, 0x1D }; // SRL H    RR L
+#define rsh_hl MULTI_BYTE_CMD(rsh_hl)
+#define set_h_l write_byte(0x65)
+#define set_l_h write_byte(0x6C)
 
 
 void generate_statement(Node* statement);
@@ -280,6 +427,9 @@ byte is_binary_operator(byte type)
 	case AMP:
 	case PIPE:
 	case CARET:
+	case STAR:
+	case SLASH:
+	case PERCENT:
 		return 1;
 	}
 	return 0;
@@ -331,33 +481,19 @@ word type_size(word line, BaseType* base_type)
 	return 0;
 }
 
-word calculate_struct_size(word line, Struct* s)
-{
-	word n=vector_size(s->fields);
-	word sum = 0;
-	for (word i = 0; i < n; ++i)
-	{
-		Field* field = (Field*)vector_access(s->fields, i);
-		sum+=field->length * type_size(line, &field->type);
-	}
-	return sum;
-}
-
 Struct* find_struct(word line, word name)
 {
-	word n = vector_size(structs);
-	for (word i = 0; i < n; ++i)
-	{
-		Struct* s = (Struct*)vector_access(structs, i);
-		if (s->name == name) return s;
-	}
+	word index;
+	if (symtab_get(struct_names, name, &index))
+		return (Struct*)vector_access(structs, index);
 	ERROR_RET(line,UNKNOWN_STRUCT);
 	return 0;
 }
 
 word struct_size(word line, word name)
 {
-	return calculate_struct_size(line, find_struct(line, name));
+	Struct* s = find_struct(line, name);
+	return s ? s->size : 0;
 }
 
 // Given a struct name and field name, calculate the relative term.
@@ -367,20 +503,19 @@ void struct_field_offset(word line, word struct_name, word field_name, Term* res
 	res->location = IMMEDIATE;
 	res->immediate = 0;
 	Struct* s=find_struct(line, struct_name);
-	word offset = 0;
+	if (!s) return;
 	word n=vector_size(s->fields);
 	for (word i = 0; i < n; ++i)
 	{
 		Field* field = (Field*)vector_access(s->fields, i);
 		if (field->name == field_name)
 		{
-			res->immediate=offset;
+			res->immediate=field->offset;
 			res->type.base_type = field->type;
 			if (length && field->type.type == ARRAY)
 				*length = field->length;
 			break;
 		}
-		offset += field->length * type_size(line, &field->type);
 	}
 }
 
@@ -418,6 +553,17 @@ word local_var_size(Node* node)
 	return sum;
 }
 
+// Variables of a function shadow globals.  Within the same scope
+// the first declaration of a name is the one that is used.
+void push_variable(word line, Variable* var)
+{
+	word index;
+	if (!vector_push(variables, var)) ERROR_RET(line, OUT_OF_MEMORY);
+	if (symtab_get(variable_names, var->name, &index) && index >= locals_start) return;
+	if (!symtab_set(variable_names, var->name, vector_size(variables) - 1))
+		ERROR_RET(line, OUT_OF_MEMORY);
+}
+
 word calculate_parameters(Node* param, word offset)
 {
 	if (param)
@@ -432,11 +578,88 @@ word calculate_parameters(Node* param, word offset)
 		var.size = 2;
 		var.type.base_type = param->data_type;
 		var.type.local = 1;
-		vector_push(variables, &var);
+		push_variable(param->line, &var);
 	}
 	return offset;
 }
 
+// Fast calling convention: the first byte parameter is passed in A,
+// the first word (or pointer) in HL and the second in DE
+#define FAST_A	1
+#define FAST_HL	2
+#define FAST_DE	4
+
+// Register of a fast call parameter, given the registers already taken
+byte fast_register(word line, BaseType* type, byte used)
+{
+	if (type->type == VAR && type->sub_type == PRIMITIVE && type_size(line, type) == 1)
+	{
+		if (!(used & FAST_A)) return FAST_A;
+	}
+	else
+	{
+		if (!(used & FAST_HL)) return FAST_HL;
+		if (!(used & FAST_DE)) return FAST_DE;
+	}
+	ERROR_RET(line, FAST_PARAMS);
+	return 0;
+}
+
+// The prologue of a fast function pushes HL, DE and AF, whichever carry
+// parameters, and the parameters are then read from these slots
+word fast_slot(byte reg, byte used)
+{
+	word offset = 0;
+	if (used & FAST_HL)
+	{
+		offset -= 2;
+		if (reg == FAST_HL) return offset;
+	}
+	if (used & FAST_DE)
+	{
+		offset -= 2;
+		if (reg == FAST_DE) return offset;
+	}
+	return offset - 1; // A is the high byte of AF
+}
+
+word fast_slots_size(byte used)
+{
+	word size = 0;
+	if (used & FAST_HL) size += 2;
+	if (used & FAST_DE) size += 2;
+	if (used & FAST_A) size += 2;
+	return size;
+}
+
+// Returns the size of the parameter slots below the frame pointer
+word scan_fast_parameters(Node* fun, byte* registers)
+{
+	Node* param;
+	byte used = 0;
+	for (param = fun->parameters; param; param = param->sibling)
+	{
+		if (param->data_type.type != VAR || param->data_type.sub_type != PRIMITIVE)
+			ERROR_RET(param->line, INVALID_TYPE);
+		used |= fast_register(param->line, &param->data_type, used);
+	}
+	*registers = used;
+	byte assigned = 0;
+	for (param = fun->parameters; param; param = param->sibling)
+	{
+		Variable var;
+		byte reg = fast_register(param->line, &param->data_type, assigned);
+		assigned |= reg;
+		var.name = param->name;
+		var.address = fast_slot(reg, used);
+		var.size = 2;
+		var.type.base_type = param->data_type;
+		var.type.local = 1;
+		push_variable(param->line, &var);
+	}
+	return fast_slots_size(used);
+}
+
 void scan_parameters(Node* fun)
 {
 	if (fun)
@@ -473,7 +696,7 @@ word scan_variables(Node* node, word offset, byte local)
 				var.address = offset;
 				offset += effective_size;
 			}
-			vector_push(variables, &var);
+			push_variable(child->line, &var);
 			sum += effective_size;
 		}
 		else
@@ -502,6 +725,24 @@ void generate_shift_a_c(byte opcode)
 	WRITE(cmd);
 }
 
+// Generate   a=a*c  (low byte)
+void generate_mult_a_c()
+{
+	/*
+	*			l=a
+	*			a=0
+	*			b=8
+	* loop:		a<<=1
+	*			c<<=1
+	*			if carry a+=l
+	*			b=b-1
+	*			if b!=0 goto loop
+	*/
+	//                   l=a   a=0   b=8          a<<=1  sla c        jnc   +1    a+=l  jnz loop
+	const byte cmd[] = { 0x6F, 0xAF, 0x06, 0x08, 0x87,  0xCB, 0x21,  0x30, 0x01, 0x85, 0x10, 0xF8 };
+	WRITE(cmd);
+}
+
 void generate_rsh_hl_c()
 {
 	/*
@@ -534,25 +775,678 @@ void generate_lsh_hl_c()
 	WRITE(cmd);
 }
 
-byte find_variable(word name, Variable* var)
+Variable* find_variable(word name)
+{
+	word index;
+	if (!symtab_get(variable_names, name, &index)) return 0;
+	return (Variable*)vector_access(variables, index);
+}
+
+void set_prim_type(BaseType* t, byte type_name)
+{
+	t->type = VAR;
+	t->sub_type = PRIMITIVE;
+	t->type_name = type_name;
+}
+
+void get_node_address(Node* node, Term*, word* length);
+void calculate_expression(Node* node, Term* res);
+
+byte is_commutative(byte type)
+{
+	return (type == PLUS || type == AMP || type == PIPE || type == CARET || type == STAR);
+}
+
+// Call one of the helpers from generate_common_functions
+void call_common(word line, const char* name)
+{
+	word addr = get_known_address(line, sh_get(texts, name));
+	add_relocation(write_offset + 1);
+	const byte cmd[] = { 0xCD, (addr & 0xFF), (addr >> 8) };
+	WRITE(cmd);
+}
+
+byte bit_length(word w)
+{
+	byte n = 0;
+	for (; w; w >>= 1) ++n;
+	return n;
+}
+
+byte bit_count(word w)
+{
+	byte n = 0;
+	for (; w; w >>= 1) n += (w & 1);
+	return n;
+}
+
+byte is_power_of_two(word w)
+{
+	return w != 0 && (w & (w - 1)) == 0;
+}
+
+// Longest shift and add sequence generated instead of calling mult_bc_de
+#define MAX_INLINE_MULTIPLY 14
+
+// hl*=m.  Adds the original value, kept in BC, for every set bit
+void multiply_hl(word line, word m)
+{
+	if (m == 0)
+	{
+		set_hl_immed(0);
+		return;
+	}
+	byte top = bit_length(m) - 1;
+	if (is_power_of_two(m))
+	{
+		for (byte b = 0; b < top; ++b)
+			add_hl_hl;
+		return;
+	}
+	set_bc_hl;
+	if ((top + bit_count(m) - 1) > MAX_INLINE_MULTIPLY)
+	{
+		set_de_immed(m);
+		call_common(line, "mult_bc_de");
+		return;
+	}
+	for (byte bit = top; bit > 0; --bit)
+	{
+		add_hl_hl;
+		if (m & (1 << (bit - 1))) add_hl_bc;
+	}
+}
+
+// a*=n (low byte).  The original value is kept in L
+void multiply_a(byte n)
+{
+	if (n == 0)
+	{
+		xor_a;
+		return;
+	}
+	if (!is_power_of_two(n)) set_l_a;
+	for (byte bit = bit_length(n) - 1; bit > 0; --bit)
+	{
+		add_a_a;
+		if (n & (1 << (bit - 1))) add_a_l;
+	}
+}
+
+// Find m and shift (8 or more) such that (x*m)>>shift == x/d for every
+// byte x, with x*m fitting in HL
+byte byte_reciprocal(byte d, word* m, byte* shift)
+{
+	if (d < 2) return 0;
+	for (byte s = 8; s <= 16; ++s)
+	{
+		unsigned long r = ((1UL << s) + d - 1) / d;
+		if (r * 255 > 0xFFFF) return 0;
+		word x = 0;
+		for (; x < 256; ++x)
+			if (((x * r) >> s) != x / d) break;
+		if (x == 256)
+		{
+			*m = (word)r;
+			*shift = s;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// hl>>=count
+void shift_right_hl(byte count)
+{
+	if (count >= 16)
+	{
+		set_hl_immed(0);
+		return;
+	}
+	if (count >= 8) { set_l_h; set_h_immed(0); count -= 8; }
+	for (; count > 0; --count) rsh_hl;
+}
+
+// a/=d or a%=d.  Constant divisors are powers of two or a reciprocal
+// multiply, anything else goes to div_hl_de
+void divide_a(word line, byte d, byte remainder)
+{
+	word m;
+	byte shift;
+	if (is_power_of_two(d))
+	{
+		if (remainder)
+		{
+			if (d == 1) xor_a;
+			else alu_a_immed(AND_N, d - 1);
+		}
+		else
+			for (byte b = bit_length(d) - 1; b > 0; --b) srl_a;
+	}
+	else
+	if (byte_reciprocal(d, &m, &shift))
+	{
+		if (remainder) push_af;
+		set_hl_a;
+		multiply_hl(line, m);
+		set_a_h;
+		for (shift -= 8; shift > 0; --shift) srl_a;
+		if (remainder)
+		{
+			multiply_a(d);
+			set_c_a;
+			pop_af;
+			sub_c;
+		}
+	}
+	else
+	{
+		set_hl_a;
+		set_de_immed(d);
+		call_common(line, "div_hl_de");
+		if (remainder) set_a_e;
+		else set_a_l;
+	}
+}
+
+// hl/=d or hl%=d
+void divide_hl(word line, word d, byte remainder)
+{
+	if (is_power_of_two(d))
+	{
+		if (!remainder) shift_right_hl(bit_length(d) - 1);
+		else
+		if (d == 1) set_hl_immed(0);
+		else
+		if (d <= 0x100)
+		{
+			set_a_l;
+			alu_a_immed(AND_N, d - 1);
+			set_hl_a;
+		}
+		else
+		{
+			set_a_h;
+			alu_a_immed(AND_N, (d - 1) >> 8);
+			set_h_a;
+		}
+		return;
+	}
+	set_de_immed(d);
+	call_common(line, "div_hl_de");
+	if (remainder) ex_de_hl;
+}
+
+// Evaluate a subtree made only of numbers without generating code.
+// Operations on two immediates are byte sized, the same as the
+// code generated for them at runtime.
+byte constant_value(Node* node, word* value)
+{
+	if (node->type == NUMBER)
+	{
+		*value = node->name;
+		return 1;
+	}
+	if (node->type == LPAREN) return constant_value(node->child, value);
+	if (!is_binary_operator(node->type) || !node->child || !node->child->sibling) return 0;
+	word left, right;
+	if (!constant_value(node->child, &left) || !constant_value(node->child->sibling, &right)) return 0;
+	byte a = left & 0xFF, b = right & 0xFF;
+	switch (node->type)
+	{
+	case PLUS: a += b; break;
+	case MINUS: a -= b; break;
+	case LSH: a = (b < 8 ? (a << b) : 0); break;
+	case RSH: a = (b < 8 ? (a >> b) : 0); break;
+	case AMP: a &= b; break;
+	case PIPE: a |= b; break;
+	case CARET: a ^= b; break;
+	case STAR: a *= b; break;
+	case SLASH: a = (b ? a / b : 0xFF); break;	// As div_hl_de
+	case PERCENT: a = (b ? a % b : a); break;
+	}
+	*value = a;
+	return 1;
+}
+
+// Apply a binary operator with a constant right operand to an
+// evaluated term, using the immediate forms and skipping identities
+void generate_immediate_operation(Node* node, Term* left, word value, Term* res)
+{
+	word size = 1;
+	if (left->location != IMMEDIATE)
+		size = type_size(node->line, &left->type.base_type);
+	byte count = value & 0xFF;
+	if (size > 1)
+	{
+		set_hl_res(node->line, left);
+		res->location = HL; set_prim_type(&res->type.base_type, WORD);
+		switch (node->type)
+		{
+		case PLUS:
+			if (value <= 3) { for (byte i = 0; i < value; ++i) inc_hl; }
+			else { set_bc_immed(value); add_hl_bc; }
+			break;
+		case MINUS:
+			if (value <= 3) { for (byte i = 0; i < value; ++i) dec_hl; }
+			else { set_bc_immed(-value); add_hl_bc; }
+			break;
+		case LSH:
+			if (count >= 16) { set_hl_immed(0); break; }
+			if (count >= 8) { set_h_l; set_l_immed(0); count -= 8; }
+			for (; count > 0; --count) add_hl_hl;
+			break;
+		case RSH: shift_right_hl(count); break;
+		case STAR: multiply_hl(node->line, value); break;
+		case SLASH: divide_hl(node->line, value, 0); break;
+		case PERCENT: divide_hl(node->line, value, 1); break;
+		default: ERROR_RET(node->line, UNSUPPORTED);
+		}
+	}
+	else
+	{
+		set_a_res(node->line, left);
+		res->location = A; set_prim_type(&res->type.base_type, BYTE);
+		switch (node->type)
+		{
+		case PLUS:
+			if (count == 1) inc_a;
+			else if (count == 0xFF) dec_a;
+			else if (count != 0) alu_a_immed(ADD_A_N, count);
+			break;
+		case MINUS:
+			if (count == 1) dec_a;
+			else if (count != 0) alu_a_immed(SUB_N, count);
+			break;
+		case AMP:
+			if (count == 0) xor_a;
+			else if (count != 0xFF) alu_a_immed(AND_N, count);
+			break;
+		case PIPE: if (count != 0) alu_a_immed(OR_N, count); break;
+		case CARET:
+			if (count == 0xFF) cpl;
+			else if (count != 0) alu_a_immed(XOR_N, count);
+			break;
+		case LSH:
+			if (count >= 8) { xor_a; break; }
+			for (; count > 0; --count) add_a_a;
+			break;
+		case RSH:
+			if (count >= 8) { xor_a; break; }
+			for (; count > 0; --count) srl_a;
+			break;
+		case STAR: multiply_a(count); break;
+		case SLASH: divide_a(node->line, count, 0); break;
+		case PERCENT: divide_a(node->line, count, 1); break;
+		default: ERROR_RET(node->line, UNSUPPORTED);
+		}
+	}
+}
+
+// Evaluating a subtree that contains one of these node types may
+// change memory or registers beyond A, BC and HL
+byte contains_node(Node* node, byte type1, byte type2)
+{
+	if (node->type == type1 || node->type == type2) return 1;
+	for (Node* child = node->child; child; child = child->sibling)
+		if (contains_node(child, type1, type2)) return 1;
+	for (Node* param = node->parameters; param; param = param->sibling)
+		if (contains_node(param, type1, type2)) return 1;
+	return 0;
+}
+
+// Frame offsets reachable with (ix+d)
+byte ix_reachable(word address, word size)
+{
+	word first = (address & 0xFF80);
+	word last = ((address + size - 1) & 0xFF80);
+	return (first == 0 || first == 0xFF80) && (last == 0 || last == 0xFF80);
+}
+
+// Resolve a variable, or an array element / struct field of one, whose
+// address is known at compile time.  No code is generated
+byte fixed_address(Node* node, Variable* var, word* length)
+{
+	if (node->type == IDENT)
+	{
+		Variable* v = find_variable(node->name);
+		if (!v) return 0;
+		byte aggregate = (v->type.base_type.type == ARRAY || v->type.base_type.sub_type == STRUCT);
+		if (aggregate && v->type.local && v->address < 0x100) return 0; // parameter pointer
+		if (v->type.base_type.type == ARRAY && v->size == 0) return 0; // array pointer
+		*var = *v;
+		if (var->type.base_type.type == ARRAY) *length = var->size;
+		return 1;
+	}
+	if (node->type == INDEX)
+	{
+		word index;
+		if (!fixed_address(node->child, var, length) || var->type.base_type.type != ARRAY) return 0;
+		if (!constant_value(node->child->sibling, &index)) return 0;
+		if (*length > 0 && index >= *length) return 0; // reported by get_node_address
+		word elem_size = type_size(node->line, &var->type.base_type);
+		var->address += index * elem_size;
+		var->type.base_type.type = VAR;
+		return 1;
+	}
+	if (node->type == DOT)
+	{
+		Term field;
+		if (!fixed_address(node->child, var, length) || var->type.base_type.sub_type != STRUCT) return 0;
+		struct_field_offset(node->line, var->type.base_type.type_name, node->child->sibling->name, &field, length);
+		var->address += field.immediate;
+		var->type.base_type = field.type.base_type;
+		return 1;
+	}
+	return 0;
+}
+
+// A primitive variable that can be read with a single addressing
+// mode, without disturbing other registers.  When element is given,
+// array elements and struct fields at fixed addresses qualify too,
+// and are resolved into it
+Variable* leaf_variable(Node* node, Variable* element)
+{
+	if (node->type == LPAREN) return leaf_variable(node->child, element);
+	Variable* var = 0;
+	word length = 0;
+	if (node->type == IDENT) var = find_variable(node->name);
+	else
+	if (element && (node->type == INDEX || node->type == DOT) && fixed_address(node, element, &length))
+		var = element;
+	if (!var || var->type.base_type.type == ARRAY || var->type.base_type.sub_type == STRUCT) return 0;
+	if (var->type.local && !ix_reachable(var->address, type_size(node->line, &var->type.base_type))) return 0;
+	return var;
+}
+
+word term_size(word line, Term* t)
+{
+	if (t->location == IMMEDIATE) return 1;
+	return type_size(line, &t->type.base_type);
+}
+
+void leaf_term(Variable* var, Term* t)
+{
+	t->location = var->type.local ? STACK : GLOBAL;
+	t->type = var->type;
+}
+
+// ld a,(var)  (low byte of a word)
+void load_a_var(Variable* var)
+{
+	if (var->type.local) ld_a_mem_ix(var->address);
+	else ld_a_mem_immed(var->address);
+}
+
+// ld hl,(var) zero extending a byte.  May use A
+void load_hl_var(word line, Variable* var)
+{
+	if (type_size(line, &var->type.base_type) > 1)
+	{
+		if (var->type.local)
+		{
+			ld_l_mem_ix(var->address);
+			ld_h_mem_ix(var->address + 1);
+		}
+		else ld_hl_mem_immed(var->address);
+	}
+	else
+	{
+		load_a_var(var);
+		set_hl_a;
+	}
+}
+
+// ld bc,(var) zero extending a byte.  May use A
+void load_bc_var(word line, Variable* var)
+{
+	if (type_size(line, &var->type.base_type) > 1)
+	{
+		if (var->type.local)
+		{
+			ld_c_mem_ix(var->address);
+			ld_b_mem_ix(var->address + 1);
+		}
+		else ld_bc_mem_immed(var->address);
+	}
+	else
+	{
+		load_a_var(var);
+		set_c_a;
+		set_b_immed(0);
+	}
+}
+
+// ld c,(var) keeping A
+void load_c_var(Variable* var)
+{
+	if (var->type.local) ld_c_mem_ix(var->address);
+	else ld_bc_mem_immed(var->address);
+}
+
+// Register form of the 8 bit ALU operators (ADD A,r ...), 0 if none
+byte alu_opcode(byte type)
 {
-	word n = vector_size(variables);
-	for (word i = 0; i < n; ++i)
+	switch (type)
 	{
-		vector_get(variables, i, var);
-		if (var->name == name) return 1;
+	case PLUS: return 0x80;
+	case MINUS: return 0x90;
+	case AMP: return 0xA0;
+	case CARET: return 0xA8;
+	case PIPE: return 0xB0;
+	case LT: case GT: case LE: case GE: case EQ: case NE: return 0xB8;
 	}
 	return 0;
 }
 
-void set_prim_type(BaseType* t, byte type_name)
+// op a,(var).  May use HL
+void alu_a_var(byte opcode, Variable* var)
 {
-	t->type = VAR;
-	t->sub_type = PRIMITIVE;
-	t->type_name = type_name;
+	if (var->type.local)
+	{
+		const byte cmd[] = { 0xDD, opcode | 6, (byte)var->address };
+		WRITE(cmd);
+	}
+	else
+	{
+		ld_hl_var_address(var);
+		write_byte(opcode | 6);
+	}
 }
 
-void get_node_address(Node* node, Term*, word* length);
+// Expressions are evaluated into A or HL.  While the left value of a
+// binary operator waits for the right one it is kept in E or DE, unless
+// the right side needs DE itself, and only then spilled to the stack.
+static byte de_busy = 0;
+
+// Calls, indexing at run time (bounds check and element scaling),
+// multiplication and division use DE
+byte uses_de(Node* node)
+{
+	Variable element;
+	if (leaf_variable(node, &element)) return 0;
+	if (node->type == CALL || node->type == INDEX || node->type == STAR ||
+		node->type == SLASH || node->type == PERCENT) return 1;
+	for (Node* child = node->child; child; child = child->sibling)
+		if (uses_de(child)) return 1;
+	for (Node* param = node->parameters; param; param = param->sibling)
+		if (uses_de(param)) return 1;
+	return 0;
+}
+
+byte can_hold_de(Node* node)
+{
+	return !de_busy && !uses_de(node);
+}
+
+// Apply the operator to A,C (bytes) or HL,BC (words)
+void generate_operator(Node* node, word max_size, Term* res)
+{
+	if (max_size > 1)
+	{
+		res->location = HL; set_prim_type(&res->type.base_type, WORD);
+		switch (node->type)
+		{
+		case PLUS: add_hl_bc; break;
+		case MINUS: sub_hl_bc; break;
+		case LSH: generate_lsh_hl_c(); break;
+		case RSH: generate_rsh_hl_c(); break;
+		case STAR:
+			set_de_hl;
+			call_common(node->line, "mult_bc_de");
+			break;
+		case SLASH:
+		case PERCENT:
+			set_de_bc;
+			call_common(node->line, "div_hl_de");
+			if (node->type == PERCENT) ex_de_hl;
+			break;
+		default: ERROR_RET(node->line,UNSUPPORTED);
+		}
+	}
+	else
+	{
+		switch (node->type)
+		{
+		case STAR: generate_mult_a_c(); break;
+		case SLASH:
+		case PERCENT:
+			set_hl_a;
+			set_d_immed(0);
+			set_e_c;
+			call_common(node->line, "div_hl_de");
+			if (node->type == PERCENT) set_a_e;
+			else set_a_l;
+			break;
+		case PLUS: add_c; break;
+		case MINUS: sub_c; break;
+		case LSH: generate_shift_a_c(0x27); break;
+		case RSH: generate_shift_a_c(0x3F); break;
+		case AMP: and_c; break;
+		case PIPE: or_c; break;
+		case CARET: xor_c; break;
+		default: ERROR_RET(node->line, UNSUPPORTED);
+		}
+		res->location = A;
+		set_prim_type(&res->type.base_type, BYTE);
+	}
+}
+
+// Order the operands so the simple side is read last, straight into
+// its register
+void generate_binary_operation(Node* node, Term* res)
+{
+	Node* left_node = node->child;
+	Node* right_node = node->child->sibling;
+	Term left, right;
+	word value;
+	Variable element;
+	Variable* var;
+	word max_size;
+	if ((var = leaf_variable(right_node, &element)) != 0)
+	{
+		calculate_expression(left_node, &left);
+		leaf_term(var, &right);
+		max_size = (term_size(node->line, &left) > 1 || term_size(node->line, &right) > 1) ? 2 : 1;
+		if (max_size > 1)
+		{
+			set_hl_res(node->line, &left);
+			load_bc_var(node->line, var);
+		}
+		else
+		{
+			set_a_res(node->line, &left);
+			if (alu_opcode(node->type))
+			{
+				alu_a_var(alu_opcode(node->type), var);
+				res->location = A;
+				set_prim_type(&res->type.base_type, BYTE);
+				return;
+			}
+			load_c_var(var);
+		}
+	}
+	else
+	if (((var = leaf_variable(left_node, &element)) != 0 || constant_value(left_node, &value)) &&
+		!contains_node(right_node, CALL, CALL))
+	{
+		// Reading the left side after the right one is only safe
+		// when the right side has no side effects
+		calculate_expression(right_node, &right);
+		if (var) leaf_term(var, &left);
+		else left.location = IMMEDIATE;
+		max_size = (term_size(node->line, &left) > 1 || term_size(node->line, &right) > 1) ? 2 : 1;
+		if (max_size > 1)
+		{
+			set_hl_res(node->line, &right);
+			set_bc_hl;
+			if (var) load_hl_var(node->line, var);
+			else set_hl_immed(value);
+		}
+		else
+		{
+			set_a_res(node->line, &right);
+			if (var && is_commutative(node->type) && alu_opcode(node->type))
+			{
+				alu_a_var(alu_opcode(node->type), var);
+				res->location = A;
+				set_prim_type(&res->type.base_type, BYTE);
+				return;
+			}
+			set_c_a;
+			if (var) load_a_var(var);
+			else set_a_immed(value);
+		}
+	}
+	else
+	{
+		calculate_expression(left_node, &left);
+		if (can_hold_de(right_node))
+		{
+			byte left_byte = (left.location == A);
+			if (left_byte) set_e_a;
+			else
+			{
+				set_hl_res(node->line, &left);
+				ex_de_hl;
+			}
+			de_busy = 1;
+			calculate_expression(right_node, &right);
+			de_busy = 0;
+			max_size = (term_size(node->line, &left) > 1 || term_size(node->line, &right) > 1) ? 2 : 1;
+			if (max_size > 1)
+			{
+				set_hl_res(node->line, &right);
+				set_bc_hl;
+				if (left_byte)
+				{
+					set_l_e;
+					set_h_immed(0);
+				}
+				else ex_de_hl;
+			}
+			else
+			{
+				set_a_res(node->line, &right);
+				set_c_a;
+				set_a_e;
+			}
+		}
+		else
+		{
+			// Spill the left value while the right side is calculated
+			set_hl_res(node->line, &left);
+			push_hl;
+			calculate_expression(right_node, &right);
+			max_size = (term_size(node->line, &left) > 1 || term_size(node->line, &right) > 1) ? 2 : 1;
+			set_hl_res(node->line, &right);
+			set_bc_hl;
+			pop_hl;
+			if (max_size == 1) set_a_l;
+		}
+	}
+	generate_operator(node, max_size, res);
+}
 
 void calculate_expression(Node* node, Term* res)
 {
@@ -564,19 +1458,19 @@ void calculate_expression(Node* node, Term* res)
 	}
 	else if (node->type == IDENT)
 	{
-		Variable var;
-		if (find_variable(node->name, &var))
+		Variable* var = find_variable(node->name);
+		if (var)
 		{
-			res->type = var.type;
-			if (var.type.base_type.type == ARRAY || var.type.base_type.sub_type == STRUCT)
+			res->type = var->type;
+			if (var->type.base_type.type == ARRAY || var->type.base_type.sub_type == STRUCT)
 			{
-				ld_hl_immed(var.address);
-				if (var.type.local)
+				ld_hl_var_address(var);
+				if (var->type.local)
 				{
 					push_ix;
 					pop_bc;
 					add_hl_bc;
-					if (var.address < 0x100) // function parameter
+					if (var->address < 0x100) // function parameter
 					{
 						ld_bc_mem_hl;
 						set_hl_bc;
@@ -587,28 +1481,28 @@ void calculate_expression(Node* node, Term* res)
 			}
 			else
 			{
-				word size = type_size(node->line, &var.type.base_type);
-				if (var.type.local)
+				word size = type_size(node->line, &var->type.base_type);
+				if (var->type.local)
 				{
-					word mask = (var.address & 0xFF80);
+					word mask = (var->address & 0xFF80);
 
 					if (mask == 0 || mask == 0xFF80) // 0 of FF80 for low offset
 					{
 						if (size == 1)
 						{
-							ld_a_mem_ix(var.address);
+							ld_a_mem_ix(var->address);
 							res->location = A;
 						}
 						else
 						{
-							ld_l_mem_ix(var.address);
-							ld_h_mem_ix(var.address + 1);
+							ld_l_mem_ix(var->address);
+							ld_h_mem_ix(var->address + 1);
 							res->location = HL;
 						}
 					}
 					else
 					{
-						set_hl_immed(var.address);
+						set_hl_immed(var->address);
 						push_ix;
 						pop_bc;
 						add_hl_bc;
@@ -631,12 +1525,12 @@ void calculate_expression(Node* node, Term* res)
 				{
 					if (size == 1)
 					{
-						ld_a_mem_immed(var.address);
+						ld_a_mem_immed(var->address);
 						res->location = A;
 					}
 					else
 					{
-						ld_hl_mem_immed(var.address);
+						ld_hl_mem_immed(var->address);
 						res->location = HL;
 					}
 				}
@@ -646,6 +1540,25 @@ void calculate_expression(Node* node, Term* res)
 	}
 	else if (node->type == DOT || node->type == INDEX)
 	{
+		Variable element;
+		Variable* var = leaf_variable(node, &element);
+		if (var)
+		{
+			// Constant index and field offsets are folded into the operand
+			res->type = var->type;
+			res->type.local = 0;
+			if (type_size(node->line, &var->type.base_type) == 1)
+			{
+				load_a_var(var);
+				res->location = A;
+			}
+			else
+			{
+				load_hl_var(node->line, var);
+				res->location = HL;
+			}
+			return;
+		}
 		word length=0;
 		get_node_address(node, res, &length);
 		pop_hl;
@@ -675,49 +1588,27 @@ void calculate_expression(Node* node, Term* res)
 	{
 		if (!node->child || !node->child->sibling) ERROR_RET(node->line,MISSING_NODE);
 		Term left,right;
-		calculate_expression(node->child,&left);
-		// Place the left value on the stack
-		set_hl_res(node->line, &left);
-		push_hl;
-		calculate_expression(node->child->sibling,&right);
-		word left_size = 1, right_size = 1;
-		if (left.location!=IMMEDIATE) 
-			left_size = type_size(node->line, &left.type.base_type);
-		if (right.location != IMMEDIATE)
-			right_size = type_size(node->line, &right.type.base_type);
-		word max_size = (left_size > 1 || right_size > 1) ? 2 : 1;
-		set_hl_res(node->line, &right);
-		set_bc_hl;
-		pop_hl;
-		if (max_size > 1)
+		word value;
+		if (constant_value(node, &value))
 		{
-			res->location = HL; set_prim_type(&res->type.base_type, WORD);
-			switch (node->type)
-			{
-			case PLUS: add_hl_bc; break;
-			case MINUS: sub_hl_bc; break;
-			case LSH: generate_lsh_hl_c(); break;
-			case RSH: generate_rsh_hl_c(); break;
-			default: ERROR_RET(node->line,UNSUPPORTED);
-			}
+			res->location = IMMEDIATE;
+			res->immediate = value;
+			res->type.local = 0;
+			return;
 		}
-		else
+		if (constant_value(node->child->sibling, &value))
 		{
-			set_a_l;
-			switch (node->type)
-			{
-			case PLUS: add_c; break;
-			case MINUS: sub_c; break;
-			case LSH: generate_shift_a_c(0x27); break;
-			case RSH: generate_shift_a_c(0x3F); break;
-			case AMP: and_c; break;
-			case PIPE: or_c; break;
-			case CARET: xor_c; break;
-			default: ERROR_RET(node->line, UNSUPPORTED);
-			}
-			res->location = A;
-			set_prim_type(&res->type.base_type, BYTE);
+			calculate_expression(node->child, &left);
+			generate_immediate_operation(node, &left, value, res);
+			return;
+		}
+		if (is_commutative(node->type) && constant_value(node->child, &value))
+		{
+			calculate_expression(node->child->sibling, &right);
+			generate_immediate_operation(node, &right, value, res);
+			return;
 		}
+		generate_binary_operation(node, res);
 	}
 	else if (node->type == CALL)
 	{
@@ -735,35 +1626,6 @@ void calculate_expression(Node* node, Term* res)
 	} else ERROR_RET(node->line,UNSUPPORTED);
 }
 
-void shift_left_hl(byte bits)
-{
-	for (byte b = 0; b < bits; ++b)
-		lsh_hl;
-}
-
-void multiply_hl(word line, word m)
-{
-#define SHIFT_CASE(x) case (1<<x): shift_left_hl(x); break
-	switch (m)
-	{
-		SHIFT_CASE(1);
-		SHIFT_CASE(2);
-		SHIFT_CASE(3);
-		SHIFT_CASE(4);
-		SHIFT_CASE(5);
-		SHIFT_CASE(6);
-		SHIFT_CASE(7);
-		SHIFT_CASE(8);
-	default:
-		set_bc_hl;
-		set_de_immed(m);
-		word addr = get_known_address(line, sh_get(texts, "mult_bc_de"));
-		const byte cmd[] = { 0xCD, (addr & 0xFF), (addr >> 8) };
-		WRITE(cmd);
-	}
-#undef SHIFT_CASE
-}
-
 // Input:  node of address to evaluate
 // Outputs:
 //		Term - Location on STACK
@@ -773,24 +1635,24 @@ void get_node_address(Node* node, Term* res, word* length)
 	res->immediate = 0;
 	if (node->type == IDENT)
 	{
-		Variable var;
-		if (find_variable(node->name, &var))
+		Variable* var = find_variable(node->name);
+		if (var)
 		{
-			res->type = var.type;
-			if (length && var.type.base_type.type == ARRAY && var.size>0)
-				*length = var.size;
-			if (var.type.local && var.address<0x100 &&
-				(var.type.base_type.type == ARRAY || var.type.base_type.sub_type == STRUCT))
+			res->type = var->type;
+			if (length && var->type.base_type.type == ARRAY && var->size>0)
+				*length = var->size;
+			if (var->type.local && var->address<0x100 &&
+				(var->type.base_type.type == ARRAY || var->type.base_type.sub_type == STRUCT))
 			{
 				// variable is a local parameter pointer.  Load its actual address
-				ld_l_mem_ix(var.address);
-				ld_h_mem_ix(var.address+1);
+				ld_l_mem_ix(var->address);
+				ld_h_mem_ix(var->address+1);
 				res->type.local=0;
 			}
 			else
 			{
-				ld_hl_immed(var.address);
-				if (var.size == 0) // Array Pointer on stack (load the pointer)
+				ld_hl_var_address(var);
+				if (var->size == 0) // Array Pointer on stack (load the pointer)
 				{
 					res->location = GLOBAL;
 					res->type.local = 0;
@@ -830,6 +1692,7 @@ void get_node_address(Node* node, Term* res, word* length)
 			{
 				set_de_immed(*length);
 				word addr = get_known_address(node->line, sh_get(texts, "bounds_check"));
+				add_relocation(write_offset + 1);
 				const byte cmd[] = { 0xCD, (addr & 0xFF), (addr >> 8) };
 				WRITE(cmd);
 			}
@@ -877,6 +1740,8 @@ void generate_call(Node* node, Term* res)
 	word n = vector_size(fp->parameters);
 	Node* p=node->parameters;
 	byte param_count=0;
+	byte used=0;		// Fast call registers taken
+	byte pending=0;		// Fast call registers of arguments on the stack, 3 bits each
 	while (p)
 	{
 		if (param_count >= n) ERROR_RET(node->line, "Too many parameters");
@@ -901,14 +1766,48 @@ void generate_call(Node* node, Term* res)
 				res.type.base_type.type_name != param_type->type_name)
 				ERROR_RET(node->line,INVALID_TYPE);
 
-			set_hl_res(node->line, &res);
-			push_hl;
+			if (fp->fastcall)
+			{
+				byte reg = fast_register(node->line, param_type, used);
+				used |= reg;
+				if (p->sibling)
+				{
+					// Wait on the stack while the next arguments are calculated
+					set_hl_res(node->line, &res);
+					push_hl;
+					pending = (pending << 3) | reg;
+				}
+				else
+				if (reg == FAST_A) set_a_res(node->line, &res);
+				else
+				{
+					set_hl_res(node->line, &res);
+					if (reg == FAST_DE) ex_de_hl;
+				}
+			}
+			else
+			{
+				set_hl_res(node->line, &res);
+				push_hl;
+			}
 		}
 		p=p->sibling;
 	}
+	for (; pending; pending >>= 3)
+	{
+		if ((pending & 7) == FAST_A)
+		{
+			pop_bc;
+			set_a_c;
+		}
+		else
+		if ((pending & 7) == FAST_HL) pop_hl;
+		else pop_de;
+	}
 	add_unknown_address(node->name, write_offset+1);
 	const byte cmd[] = {0xCD, 0x00, 0x00};
 	WRITE(cmd);
+	if (fp->fastcall) return;
 	param_count<<=1; // word per param
 	for(byte i=0;i<param_count;++i)
 		inc_sp;
@@ -925,10 +1824,44 @@ void load_hl_stack_address(byte local)
 	}
 }
 
+// ld (var),a or ld (var),hl
+void store_var(word line, Variable* var, Term* source)
+{
+	if (type_size(line, &var->type.base_type) == 1)
+	{
+		if (source->location == STACK)
+		{
+			pop_hl;
+			set_a_l;
+		}
+		else set_a_res(line, source);
+		if (var->type.local) ld_mem_ix_a(var->address);
+		else ld_mem_immed_a(var->address);
+	}
+	else
+	{
+		set_hl_res(line, source);
+		if (var->type.local)
+		{
+			ld_mem_ix_l(var->address);
+			ld_mem_ix_h(var->address + 1);
+		}
+		else ld_mem_immed_hl(var->address);
+	}
+}
+
 void generate_assignment(Node* node)
 {
 	Node* target_node = node->child;
 	Term target_term, source_term;
+	Variable element;
+	Variable* var = leaf_variable(target_node, &element);
+	if (var)
+	{
+		calculate_expression(target_node->sibling, &source_term);
+		store_var(node->line, var, &source_term);
+		return;
+	}
 	word length=0;
 	get_node_address(target_node,&target_term,&length);
 	word target_size = type_size(node->line, &target_term.type.base_type);
@@ -955,63 +1888,141 @@ byte invert_condition(byte b)
 	return 0;
 }
 
-word clear_condition_flag(byte b)
+#define JR_ALWAYS 0x18
+
+// Jump to a label with the condition given as a JR opcode.
+// Labels that are already placed are reached with JR when in range,
+// later ones with JP, patched by fill_unknowns
+void jump_to(byte condition, word label)
+{
+	word offset = 0;
+	if (symtab_get(knowns, label, &offset))
+	{
+		short distance = (short)(offset - (write_offset + 2));
+		if (distance >= -128)
+		{
+			const byte cmd[] = { condition, (byte)distance };
+			WRITE(cmd);
+			return;
+		}
+		offset += 0x1000;
+		add_relocation(write_offset + 1);
+	}
+	else add_unknown_address(label, write_offset + 1);
+	// JR -> JP,  JR cc -> JP cc
+	const byte cmd[] = { condition == JR_ALWAYS ? 0xC3 : (0xC2 + (condition - 0x20)), (offset & 0xFF), (offset >> 8) };
+	WRITE(cmd);
+}
+
+// Jump opcode taken when the comparison holds, after CP
+byte compare_jump(Node* node)
 {
-	if (b == 0x38) return 0xA7;		// JR C  ->  AND A
-	if (b == 0x30) return 0x37;		// JR NC ->  SCF
-	if (b == 0x28) return 0x01F6;	// JR Z -> OR 1
-	if (b == 0x20) return 0xBF;		// JR NZ -> CP A
-	ERROR_RET(0xFFFF, INVALID_OPCODE);
+	switch (node->type)
+	{
+	case LT: return 0x38; // JR C
+	case GT: return 0x38; // JR C
+	case LE: return 0x30; // JR NC
+	case GE: return 0x30; // JR NC
+	case EQ: return 0x28; // JR Z
+	case NE: return 0x20; // JR NZ
+	default: ERROR_RET(node->line,UNSUPPORTED);
+	}
 	return 0;
 }
 
+// Compare the operands of a comparison.  Returns the JR opcode that
+// jumps when the comparison holds
 byte generate_condition(Node* node)
 {
-	if (node->type == PIPE)
-	{
-		byte b = generate_condition(node->child);
-		word success_end = sh_temp(texts);
-		add_unknown_address(success_end, write_offset+3);
-		const byte left_cmd[] = { invert_condition(b), 0x03, 0xC3, 0x00, 0x00 };
-		WRITE(left_cmd);
-		b = generate_condition(node->child->sibling);
-		byte right_cmd[] = { b, 0x02, 0x00, 0x00 };
-		word fail = clear_condition_flag(b);
-		right_cmd[2] = fail & 0xFF;
-		right_cmd[3] = fail >> 8;
-		WRITE(right_cmd);
-		add_known_address(success_end, write_offset);
-		return b;
-	}
-	else
-	if (node->type == AMP)
-	{
-		byte b = generate_condition(node->child);
-		word failure_end = sh_temp(texts);
-		add_unknown_address(failure_end, write_offset + 3);
-		const byte left_cmd[] = { b, 0x03, 0xC3, 0x00, 0x00 };
-		WRITE(left_cmd);
-		b = generate_condition(node->child->sibling);
-		byte right_cmd[] = { b, 0x02, 0x00, 0x00 };
-		word fail = clear_condition_flag(b);
-		right_cmd[2] = fail & 0xFF;
-		right_cmd[3] = fail >> 8;
-		add_known_address(failure_end, write_offset + 2);
-		WRITE(right_cmd);
-		return b;
-	}
-	else
+	if (node->type==LPAREN) return generate_condition(node->child);
+	byte swap = (node->type == GT || node->type == LE);
+	if (node->type == LT || node->type == GT || node->type == LE ||
+		node->type == GE || node->type == EQ || node->type == NE)
 	{
-		if (node->type==LPAREN) return generate_condition(node->child);
+		Term left,right;
+		word value;
+		Variable element;
+		Variable* var;
+		if (constant_value(node->child->sibling, &value))
+		{
+			calculate_expression(node->child, &left);
+			set_a_res(node->line, &left);
+			value &= 0xFF;
+			if (value == 0 && node->type != LT && node->type != GE)
+			{
+				// a=0  a!=0  a>0 (a!=0)  a<=0 (a=0)
+				or_a;
+				if (node->type == EQ || node->type == LE) return 0x28; // JR Z
+				return 0x20; // JR NZ
+			}
+			if (!swap)
+			{
+				alu_a_immed(CP_N, value);
+				return compare_jump(node);
+			}
+			if (value < 0xFF)
+			{
+				// a>n  ->  a>=n+1      a<=n  ->  a<n+1
+				alu_a_immed(CP_N, value + 1);
+				return invert_condition(compare_jump(node));
+			}
+			set_h_a;
+			set_a_immed(value);
+		}
+		else
+		if (constant_value(node->child, &value))
+		{
+			calculate_expression(node->child->sibling, &right);
+			set_a_res(node->line, &right);
+			if (swap)
+			{
+				alu_a_immed(CP_N, value);
+				return compare_jump(node);
+			}
+			set_h_a;
+			set_a_immed(value);
+		}
+		else
+		if ((var = leaf_variable(swap ? node->child : node->child->sibling, &element)) != 0 &&
+			(!swap || !contains_node(node->child->sibling, CALL, CALL)))
+		{
+			// Compare directly with the variable that belongs on the right of CP
+			calculate_expression(swap ? node->child->sibling : node->child, &left);
+			set_a_res(node->line, &left);
+			alu_a_var(alu_opcode(node->type), var);
+			return compare_jump(node);
+		}
+		else
+		if ((var = leaf_variable(swap ? node->child->sibling : node->child, &element)) != 0 &&
+			(swap || !contains_node(node->child->sibling, CALL, CALL)))
+		{
+			// The other side goes to H, then the variable is read into A
+			calculate_expression(swap ? node->child : node->child->sibling, &left);
+			set_a_res(node->line, &left);
+			set_h_a;
+			load_a_var(var);
+		}
 		else
 		{
-			byte swap = (node->type == GT || node->type == LE);
-			if (node->type == LT || node->type == GT || node->type == LE ||
-				node->type == GE || node->type == EQ || node->type == NE)
+			calculate_expression(node->child, &left);
+			set_a_res(node->line, &left);
+			if (can_hold_de(node->child->sibling))
+			{
+				set_e_a;
+				de_busy = 1;
+				calculate_expression(node->child->sibling, &right);
+				de_busy = 0;
+				set_a_res(node->line, &right);
+				if (swap)
+				{
+					cp_e;
+					return compare_jump(node);
+				}
+				set_h_a;
+				set_a_e;
+			}
+			else
 			{
-				Term left,right;
-				calculate_expression(node->child, &left);
-				set_a_res(node->line, &left);
 				push_af;
 				calculate_expression(node->child->sibling, &right);
 				set_a_res(node->line, &right);
@@ -1025,55 +2036,136 @@ byte generate_condition(Node* node)
 					pop_af;
 				}
 			}
-			else ERROR_RET(node->line,UNSUPPORTED);
-			write_byte(0xBC); // CP H
-			switch (node->type)
-			{
-			case LT: return 0x38; // JR C
-			case GT: return 0x38; // JR C
-			case LE: return 0x30; // JR NC
-			case GE: return 0x30; // JR NC
-			case EQ: return 0x28; // JR Z
-			case NE: return 0x20; // JR NZ
-			default: ERROR_RET(node->line,UNSUPPORTED);
-			}
 		}
 	}
-	ERROR_RET(node->line,UNSUPPORTED);
-	return 0;
+	else ERROR_RET(node->line,UNSUPPORTED);
+	cp_h;
+	return compare_jump(node);
+}
+
+// Jump to the label when the condition evaluates to 'when', otherwise
+// fall through.  & and | are lowered to short circuit branches
+void generate_branch(Node* node, byte when, word label)
+{
+	if (node->type == LPAREN)
+	{
+		generate_branch(node->child, when, label);
+		return;
+	}
+	if (node->type == AMP || node->type == PIPE)
+	{
+		// Jumping on the result that one side decides alone (false
+		// for &, true for |) tests each side in turn.  Otherwise the
+		// left side skips over the right one when it decides
+		byte decides = (node->type == PIPE);
+		if (when == decides)
+		{
+			generate_branch(node->child, when, label);
+			generate_branch(node->child->sibling, when, label);
+		}
+		else
+		{
+			word skip = sh_temp(texts);
+			generate_branch(node->child, decides, skip);
+			generate_branch(node->child->sibling, when, label);
+			add_known_address(skip, write_offset);
+		}
+		return;
+	}
+	byte jump = generate_condition(node);
+	jump_to(when ? jump : invert_condition(jump), label);
+}
+
+// A loop that tests a byte variable for non zero and decrements it as
+// its last statement:   while v!=0 (or v>0) ... v=v-1 end
+// Returns the decrement statement
+Node* counting_down(Node* loop, Variable** counter)
+{
+	Node* cond = loop->parameters;
+	word value;
+	while (cond->type == LPAREN) cond = cond->child;
+	if (cond->type != NE && cond->type != GT) return 0;
+	if (!constant_value(cond->child->sibling, &value) || (value & 0xFF) != 0) return 0;
+	Variable* var = leaf_variable(cond->child, 0);
+	if (!var || type_size(loop->line, &var->type.base_type) != 1) return 0;
+	Node* last = loop->child;
+	if (!last) return 0;
+	while (last->sibling) last = last->sibling;
+	if (last->type != ASSIGN || leaf_variable(last->child, 0) != var) return 0;
+	Node* expr = last->child->sibling;
+	while (expr->type == LPAREN) expr = expr->child;
+	if (expr->type != MINUS || leaf_variable(expr->child, 0) != var) return 0;
+	if (!constant_value(expr->child->sibling, &value) || (value & 0xFF) != 1) return 0;
+	*counter = var;
+	return last;
+}
+
+// dec (var)
+void dec_var(Variable* var)
+{
+	if (var->type.local)
+	{
+		const byte cmd[] = { 0xDD, 0x35, (byte)var->address };
+		WRITE(cmd);
+	}
+	else
+	{
+		ld_hl_var_address(var);
+		write_byte(0x35);
+	}
 }
 
 void generate_cond_block(Node* node, byte loop)
 {
 	if (!node->parameters) ERROR_RET(node->line,MISSING_NODE);
-	word start_addr = write_offset+0x1000;
-	byte jump = generate_condition(node->parameters);
-	word end_of_block = sh_temp(texts);
-	add_unknown_address(end_of_block, write_offset + 3);
-	const byte cmd[] = { jump, 0x03, 0xC3, 0x00, 0x00 };
-	WRITE(cmd);
-	generate_block(node);
+	Variable* counter;
+	Node* decrement = loop ? counting_down(node, &counter) : 0;
+	if (decrement)
+	{
+		// The counter stays in memory, since the body may use any
+		// register.  Decrementing it in place sets Z for the test.
+		word body = sh_temp(texts);
+		word end_of_loop = sh_temp(texts);
+		generate_branch(node->parameters, 0, end_of_loop);
+		add_known_address(body, write_offset);
+		for (Node* child = node->child; child != decrement; child = child->sibling)
+			generate_statement(child);
+#ifdef DEV
+		begin_line(decrement->line);
+#endif
+		dec_var(counter);
+		jump_to(0x20, body); // NZ
+		add_known_address(end_of_loop, write_offset);
+	}
+	else
 	if (loop)
 	{
-		const byte jump_back[] = { 0xC3, (start_addr & 0xFF), (start_addr >> 8) };
-		WRITE(jump_back);
+		// Test at the bottom, so each iteration takes a single branch
+		word test = sh_temp(texts);
+		word body = sh_temp(texts);
+		jump_to(JR_ALWAYS, test);
+		add_known_address(body, write_offset);
+		generate_block(node);
+		add_known_address(test, write_offset);
+		generate_branch(node->parameters, 1, body);
+	}
+	else
+	{
+		word end_of_block = sh_temp(texts);
+		generate_branch(node->parameters, 0, end_of_block);
+		generate_block(node);
+		add_known_address(end_of_block, write_offset);
 	}
-	add_known_address(end_of_block, write_offset);
 }
 
 void generate_ifelse(Node* node)
 {
 	if (!node->parameters) ERROR_RET(node->line,MISSING_NODE);
-	byte jump = generate_condition(node->parameters);
 	word end_of_true = sh_temp(texts);
-	add_unknown_address(end_of_true, write_offset + 3);
-	const byte true_cmd[] = { jump, 0x03, 0xC3, 0x00, 0x00 };
-	WRITE(true_cmd);
+	generate_branch(node->parameters, 0, end_of_true);
 	generate_block(node->child); // True side of if-else
 	word end_of_else = sh_temp(texts);
-	add_unknown_address(end_of_else, write_offset+1);
-	const byte jump_to_end[] = { 0xC3, 0x00, 0x00 };
-	WRITE(jump_to_end);
+	jump_to(JR_ALWAYS, end_of_else);
 	add_known_address(end_of_true, write_offset);
 	generate_block(node->child->sibling);
 	add_known_address(end_of_else,write_offset);
@@ -1093,16 +2185,26 @@ void generate_return(Node* node)
 		set_hl_res(node->line, &res);
 		set_de_hl;
 	}
-	add_unknown_address(function_end, write_offset+1);
-	const byte cmd[] = { 0xC3, 0x00, 0x00 };
-	WRITE(cmd);
+	if (frame_kind == FRAME_NONE) write_byte(0xC9); // RET
+	else
+	if (frame_kind == FRAME_IX)
+	{
+		const byte cmd[] = { 0xDD, 0xE1, 0xC9 }; // POP IX   RET
+		WRITE(cmd);
+	}
+	else
+	{
+		add_unknown_address(function_end, write_offset+1);
+		const byte cmd[] = { 0xC3, 0x00, 0x00 };
+		WRITE(cmd);
+	}
 }
 
 void generate_statement(Node* statement)
 {
 	Term res;
 #ifdef DEV
-	write_offset_line(statement->line);
+	begin_line(statement->line);
 #endif
 	if (statement->type == ASSIGN) generate_assignment(statement);
 	else if (statement->type == WHILE) generate_cond_block(statement,1);
@@ -1126,15 +2228,16 @@ void generate_block(Node* block)
 
 // Accepts node of funuction, memory location of the function (offset) and size of local variables
 // Returns the offset beyond the function
-void generate_function(Node* func, word locals_size)
+void generate_function(Node* func, word locals_size, byte registers)
 {
 	FunctionAddress fa;
 	function_end = sh_temp(texts);
 	function_node = func;
-	write_offset_line(func->line);
+	begin_line(func->line);
 	add_known_address(func->name,write_offset);
 	fa.start=write_offset;
-	word neg_locals = -locals_size;
+	fa.runtime=0;
+	word neg_locals = fast_slots_size(registers) - locals_size;
 	byte init_stack[] = {
 		0xDD, 0xE5,								// PUSH IX
 		0xDD,0x21,0x00,0x00,					// LD IX,#0
@@ -1148,24 +2251,44 @@ void generate_function(Node* func, word locals_size)
 		0xDD, 0xE1,								// POP IX
 		0xC9									// RET
 	};
-	WRITE(init_stack);
+	// Statements leave the stack balanced, so without locals SP is
+	// back at IX by the end and only the frame pointer itself is kept
+	frame_kind = FRAME_FULL;
+	if (locals_size == 0) frame_kind = func->parameters ? FRAME_IX : FRAME_NONE;
+	if (frame_kind != FRAME_NONE) write(init_stack, 8); // up to ADD IX,SP
+	// Fast call parameters are moved from their registers into the frame
+	if (registers & FAST_HL) push_hl;
+	if (registers & FAST_DE) push_de;
+	if (registers & FAST_A) push_af;
+	if (locals_size > fast_slots_size(registers))
+		write(init_stack + 8, sizeof(init_stack) - 8); // LD SP,SP-rest of locals
 	generate_block(func);
 	add_known_address(function_end,write_offset);
-	WRITE(close_stack);
+	if (frame_kind == FRAME_FULL) WRITE(close_stack);
+	else
+	if (frame_kind == FRAME_IX) write(close_stack + 2, 3); // POP IX   RET
+	else write_byte(0xC9); // RET
 	fa.stop=write_offset;
-	vector_push(function_addresses, &fa);
+	if (!vector_push(function_addresses, &fa))
+		ERROR_RET(func->line, OUT_OF_MEMORY);
 }
 
 // Common functions only accept and return primitives
 // Format string is one letter (B/W) for return type and one such letter
 // per parameter.  Example:  "BWW" ->  fun name(word a, word b)
+// A leading F selects the fast calling convention: "FBWW" takes a in HL
+// and b in DE
 void add_common_prototype(word name, const char* proto)
 {
 	if (proto && *proto)
 	{
+		if (!symtab_set(prototype_names, name, vector_size(function_prototypes)))
+			ERROR_RET(statement_line, OUT_OF_MEMORY);
 		FunctionPrototype fp;
 		BaseType param_type;
 		fp.name=name;
+		fp.fastcall=(*proto == 'F');
+		if (fp.fastcall) ++proto;
 		set_prim_type(&fp.return_type, *proto == 'B' ? BYTE : WORD);
 		fp.parameters=vector_new(sizeof(BaseType));
 		while (*(++proto))
@@ -1189,20 +2312,43 @@ void generate_common_functions()
 #define COMMON_FUNC(func_name,proto,...) {\
 Address address; address.name=sh_get(texts, func_name); address.address=write_offset;\
 add_common_prototype(address.name,proto);\
-vector_push(knowns, &address); const byte code_bytes[] = __VA_ARGS__; WRITE(code_bytes); }
+add_known_address(address.name, address.address); const byte code_bytes[] = __VA_ARGS__; WRITE(code_bytes);\
+FunctionAddress fa; fa.start=address.address; fa.stop=write_offset; fa.runtime=1; vector_push(function_addresses, &fa); }
+
+	//                                 ld b,h  ld c,l  (falls through to mult_bc_de)
+	COMMON_FUNC("multiply", "FBWW", { 0x44,   0x4D });
 
-	byte mult_offset=write_offset; // Assume low 0x1000 address, store low byte
 	// Generic multiplication   HL = BC * DE
 	COMMON_FUNC("mult_bc_de", "", { 0x21, 0x00, 0x00, 0x78, 0x06, 0x10, 0x29, 0xCB,
 								    0x21,0x17,0x30,0x01,0x19,0x10,0xF7,0xC9 });
 
-	COMMON_FUNC("multiply", "BWW",
-	//            pop hl  pop bc  pop de  push de   push bc  push hl  jp mult_bc_de
-				{ 0xE1,   0xC1,   0xD1,   0xD5,     0xC5,    0xE5,    0xC3, mult_offset, 0x10 });
+	// Generic division   HL = HL / DE,  DE = HL % DE
+	// Dividing by zero gives 0xFFFF and the dividend as remainder
+	COMMON_FUNC("div_hl_de", "", {
+		0x7C,				//       ld a,h          AC = dividend
+		0x4D,				//       ld c,l
+		0x21, 0x00, 0x00,	//       ld hl,0         remainder
+		0x06, 0x10,			//       ld b,16
+		0xCB, 0x21,			// loop: sla c
+		0x17,				//       rla
+		0xED, 0x6A,			//       adc hl,hl
+		0x38, 0x07,			//       jr c,over       remainder above 16 bits
+		0xED, 0x52,			//       sbc hl,de
+		0x30, 0x06,			//       jr nc,set
+		0x19,				//       add hl,de
+		0x18, 0x04,			//       jr next
+		0xB7,				// over: or a
+		0xED, 0x52,			//       sbc hl,de
+		0x0C,				// set:  inc c
+		0x10, 0xEC,			// next: djnz loop
+		0xEB,				//       ex de,hl
+		0x67,				//       ld h,a
+		0x69,				//       ld l,c
+		0xC9 });			//       ret
 	
-	// OS Service, send block to GPU
-	//                               pop bc  pop hl  push hl  push bc    ld a,service              RST 1  ret
-	COMMON_FUNC("gpu_block", "BP", { 0xC1,   0xE1,   0xE5,    0xC5,      0x3E, SERVICE_GPU_BLOCK,  0xCF,  0xC9 });
+	// OS Service, send block to GPU.  Block address in HL
+	//                                ld a,service              RST 1  ret
+	COMMON_FUNC("gpu_block", "FBP", { 0x3E, SERVICE_GPU_BLOCK,  0xCF,  0xC9 });
 
 	// OS Service, flush GPU
 	//                              ld a,service     RST 1   ret
@@ -1244,7 +2390,8 @@ void fill_unknowns()
 	{
 		Address* unk=(Address*)vector_access(unknowns,i);
 		word addr=get_known_address(0xFFFF,unk->name);
-		raw_write(unk->address,(byte*)&addr,2);
+		const byte patch[] = { addr & 0xFF, addr >> 8 };
+		patch_output(unk->address, patch, 2);
 	}
 }
 
@@ -1256,7 +2403,7 @@ void add_variable(Node* node)
 	var.address = write_offset  + 0x1000;
 	var.size = var_size(node);
 	var.type.base_type = node->data_type;
-	vector_push(variables, &var);
+	push_variable(node->line, &var);
 	const byte* data=0;
 	if (node->data_type.type==ARRAY && node->data)
 		data = vector_access(node->data, 0);
@@ -1271,8 +2418,10 @@ void add_variable(Node* node)
 
 void add_struct(Node* node)
 {
+	// Layout is computed once here, field access only reads the offsets
 	Struct s;
 	s.name= node->name;
+	s.size = 0;
 	s.fields = vector_new(sizeof(Field));
 	Node* child=node->child;
 	Field field;
@@ -1283,21 +2432,21 @@ void add_struct(Node* node)
 		field.length = 1;
 		if (child->data_type.type == ARRAY)
 			field.length = child->parameters->name;
+		field.offset = s.size;
+		s.size += field.length * type_size(child->line, &field.type);
 		vector_push(s.fields, &field);
 		child=child->sibling;
 	}
+	if (!symtab_get(struct_names, s.name, 0) && !symtab_set(struct_names, s.name, vector_size(structs)))
+		ERROR_RET(node->line, OUT_OF_MEMORY);
 	vector_push(structs, &s);
 }
 
 FunctionPrototype* find_prototype(word name)
 {
-	word n = vector_size(function_prototypes);
-	for (word i = 0; i < n; ++i)
-	{
-		FunctionPrototype* fp = vector_access(function_prototypes, i);
-		if (fp->name == name) return fp;
-	}
-	return 0;
+	word index;
+	if (!symtab_get(prototype_names, name, &index)) return 0;
+	return (FunctionPrototype*)vector_access(function_prototypes, index);
 }
 
 void add_function_prototype(Node* node)
@@ -1306,6 +2455,7 @@ void add_function_prototype(Node* node)
 	FunctionPrototype fp;
 	fp.name=node->name;
 	fp.return_type=node->data_type;
+	fp.fastcall=(node->type == FAST);
 	fp.parameters=vector_new(sizeof(BaseType));
 	Node* param=node->parameters;
 	while (param)
@@ -1313,6 +2463,8 @@ void add_function_prototype(Node* node)
 		vector_push(fp.parameters,&param->data_type);
 		param=param->sibling;
 	}
+	if (!symtab_set(prototype_names, fp.name, vector_size(function_prototypes)))
+		ERROR_RET(node->line, OUT_OF_MEMORY);
 	vector_push(function_prototypes, &fp);
 }
 
@@ -1321,11 +2473,19 @@ void add_function(Node* node)
 	add_function_prototype(node);
 	if (node->child) // not extern
 	{
+		// Function scope: locals are dropped from the table when it is left
 		word globals_size = vector_size(variables);
-		scan_parameters(node);
-		word locals_size = scan_variables(node, 0, 1);
-		generate_function(node, locals_size);
-		vector_resize(variables, globals_size); // Remove local vars
+		locals_start = globals_size;
+		if (!symtab_push(variable_names)) ERROR_RET(node->line, OUT_OF_MEMORY);
+		byte registers = 0;
+		word params_size = 0;
+		if (node->type == FAST) params_size = scan_fast_parameters(node, &registers);
+		else scan_parameters(node);
+		word locals_size = params_size + scan_variables(node, -params_size, 1);
+		generate_function(node, locals_size, registers);
+		symtab_pop(variable_names);
+		vector_resize(variables, globals_size);
+		locals_start = 0;
 	}
 }
 
@@ -1333,6 +2493,10 @@ byte generate_code(parse_node_func parse_node_, file_write_func fwf)
 {
 	parse_node = parse_node_;
 	raw_write = fwf;
+	STATS_ENTER(PHASE_CODEGEN);
+#ifdef DEV
+	open_line_offsets();
+#endif
 
 	byte header[] = { 0xC3, 0x00, 0x00 };
 	WRITE(header);
@@ -1346,22 +2510,38 @@ byte generate_code(parse_node_func parse_node_, file_write_func fwf)
 		{
 		case VAR:		add_variable(node); break;
 		case STRUCT:	add_struct(node);	break;
-		case FUN:		add_function(node);	break;
+		case FUN:
+		case FAST:		add_function(node);	break;
 		default: ERROR_RET(node->line,UNSUPPORTED);
 		}
-		release_node(node); // Rolling generation, release completed nodes
+		p_release(node); // Rolling generation, release completed nodes
 	}
+	STATS_ENTER(PHASE_FIXUP);
 	fill_unknowns();
+	STATS_LEAVE();
+	flush_output();
+#ifdef DEV
+	close_line_offsets();
+#endif
+	STATS_LEAVE();
 	return 1;
 }
 
 void gen_init()
 {
 	write_offset = 0;
+	out_base = 0;
+	out_used = 0;
 	structs = vector_new(sizeof(Struct));
 	variables = vector_new(sizeof(Variable));
-	knowns = vector_new(sizeof(Address));
+	struct_names = symtab_new();
+	variable_names = symtab_new();
+	prototype_names = symtab_new();
+	knowns = symtab_new();
 	unknowns = vector_new(sizeof(Address));
+#ifdef CODE_FILE
+	relocations.count = 0;
+#endif
 	function_addresses = vector_new(sizeof(FunctionAddress));
 	function_prototypes = vector_new(sizeof(FunctionPrototype));
 }
@@ -1376,6 +2556,13 @@ Vector* gen_get_unknowns()
 	return unknowns;
 }
 
+#ifdef CODE_FILE
+Relocations* gen_get_relocations()
+{
+	return &relocations;
+}
+#endif
+
 void gen_shut()
 {
 #ifdef DEV
@@ -1383,8 +2570,17 @@ void gen_shut()
 	close_abs_addr();
 #endif
 	vector_shut(function_addresses);
+#ifdef CODE_FILE
+	free(relocations.offsets);
+	relocations.offsets = 0;
+	relocations.count = 0;
+	relocations.capacity = 0;
+#endif
 	vector_shut(unknowns);
-	vector_shut(knowns);
+	symtab_shut(knowns);
+	symtab_shut(prototype_names);
+	symtab_shut(variable_names);
+	symtab_shut(struct_names);
 	vector_shut(variables);
 	word n=vector_size(structs);
 	for (word i = 0; i < n; ++i)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "parser.h"
+#include "optimizer.h"
 
 typedef Node* (*parse_node_func)();
 typedef byte (*file_write_func)(word offset, const byte* data, word length);
@@ -11,3 +12,6 @@ void gen_init();
 void gen_shut();
 Vector* gen_get_functions();
 Vector* gen_get_unknowns();
+#ifdef CODE_FILE
+Relocations* gen_get_relocations();
+#endif
@@ -7,6 +7,7 @@
 #define NUMBER		2
 #define EXTERN		5
 #define CONST		6
+#define FAST		7
 
 #define WFUN		9
 #define FUN			10
@@ -50,6 +51,9 @@
 #define PIPE		51
 #define CARET		52
 #define NE			53
+#define STAR		54
+#define SLASH		55
+#define PERCENT		56
 
 #define ASSIGN		60
 #define TARGET		61
@@ -0,0 +1,95 @@
+#include "arena.h"
+#include "memory.h"
+
+typedef struct arena_chunk_ ArenaChunk;
+
+// Only the current chunk has free space, so the chunks themselves
+// just link to the previous one
+struct arena_chunk_
+{
+	ArenaChunk*	next;
+};
+
+struct arena_
+{
+	ArenaChunk*	head;		// Current chunk, older chunks follow
+	word		size;		// Data size of the current chunk
+	word		used;
+	word		chunk_size;
+};
+
+#define ALIGN(x) (((x) + sizeof(void*) - 1) & ~(word)(sizeof(void*) - 1))
+#define CHUNK_DATA(c) (((byte*)(c)) + ALIGN(sizeof(ArenaChunk)))
+
+Arena* arena_new(word chunk_size)
+{
+	Arena* a = (Arena*)allocate(sizeof(Arena));
+	if (!a) return 0;
+	a->head = 0;
+	a->size = 0;
+	a->used = 0;
+	a->chunk_size = chunk_size;
+	return a;
+}
+
+static void release_chunks(ArenaChunk* c)
+{
+	while (c)
+	{
+		ArenaChunk* next = c->next;
+		release(c);
+		c = next;
+	}
+}
+
+void arena_shut(Arena* a)
+{
+	if (!a) return;
+	release_chunks(a->head);
+	release(a);
+}
+
+void* arena_alloc(Arena* a, word size)
+{
+	size = ALIGN(size);
+	// Grow the current chunk in place when the memory after it is free,
+	// so only chunks that could not grow leave unused space behind
+	if (a->head && (a->size - a->used) < size && extend(a->head, size - (a->size - a->used)))
+		a->size = a->used + size;
+	if (!a->head || (a->size - a->used) < size)
+	{
+		word chunk_size = (size > a->chunk_size ? size : a->chunk_size);
+		ArenaChunk* c = (ArenaChunk*)allocate(ALIGN(sizeof(ArenaChunk)) + chunk_size);
+		if (!c) return 0;
+		c->next = a->head;
+		a->head = c;
+		a->size = chunk_size;
+		a->used = 0;
+	}
+	void* res = CHUNK_DATA(a->head) + a->used;
+	a->used += size;
+	return res;
+}
+
+void arena_free_last(Arena* a, void* ptr)
+{
+	if (!a->head) return;
+	byte* data = CHUNK_DATA(a->head);
+	if ((byte*)ptr >= data && (byte*)ptr < (data + a->used))
+		a->used = (word)((byte*)ptr - data);
+}
+
+void arena_trim(Arena* a)
+{
+	if (!a->head || a->used == a->size) return;
+	shrink(a->head, ALIGN(sizeof(ArenaChunk)) + a->used);
+	a->size = a->used;
+}
+
+void arena_reset(Arena* a)
+{
+	release_chunks(a->head);
+	a->head = 0;
+	a->size = 0;
+	a->used = 0;
+}
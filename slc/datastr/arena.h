@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+
+typedef struct arena_ Arena;
+
+// Create a bump allocator that takes memory from the heap in chunks
+Arena*		arena_new(word chunk_size);
+
+// Destroy, releasing all chunks
+void		arena_shut(Arena*);
+
+// Allocate size bytes.  There is no individual release
+void*		arena_alloc(Arena*, word size);
+
+// Take back ptr, which must be the most recent allocation
+void		arena_free_last(Arena*, void* ptr);
+
+// Give the unused end of the current chunk back to the heap.
+// Later allocations start a new chunk
+void		arena_trim(Arena*);
+
+// Release everything allocated so far
+void		arena_reset(Arena*);
@@ -1,8 +1,13 @@
 #include <string.h>
 #include "strhash.h"
 #include "memory.h"
+#include "stats.h"
 
 #define MAX_LENGTH 16
+#define INITIAL_SLOTS 64		// Must be a power of 2
+#define INITIAL_ARENA 256
+#define EMPTY_SLOT 0xFFFF
+#define FIRST_TEMP 0xFFFE		// Temporary ids count down from here
 
 void copy_n(char* dst, const char* src, int n)
 {
@@ -15,110 +20,212 @@ void copy_n(char* dst, const char* src, int n)
 
 int compare_n(const char* a, const char* b, int n)
 {
-	for (int i = 0; i < n; ++i)
+	for (int i = 0; i < n; ++i, ++a, ++b)
 	{
 		if (*a < *b) return -1;
 		if (*a > *b) return 1;
-		if (*a == 0 && *b == 0) return 0;
+		if (*a == 0) return 0;
 	}
 	return 0;
 }
 
-static byte checksum(const char* text)
+// 16 bit variant of Jenkins' one-at-a-time hash.
+// Shifts and adds only, so it stays cheap on the z80.
+static word hash_text(const char* text)
 {
 	const byte* bytes = (const byte*)text;
-	byte res = 0xFF;
-	for (; *bytes; ++bytes)
-		res += *bytes;
-	return res;
+	word h = 0;
+	for (byte i = 0; *bytes && i < (MAX_LENGTH - 1); ++bytes, ++i)
+	{
+		h += *bytes;
+		h += (h << 10);
+		h ^= (h >> 6);
+	}
+	h += (h << 3);
+	h ^= (h >> 11);
+	h += (h << 15);
+	return h;
 }
 
-typedef struct text_node
+// Entries are indexed by id-1, so reverse lookup is a direct index.
+// Temporary ids are taken from the top of the id range and have no entry.
+typedef struct text_entry
 {
-	word id;
-	char text[MAX_LENGTH];
-	struct text_node* next;
-} TextNode;
-
-typedef TextNode* TextNodePtr;
+	word hash;
+	word text;		// Offset of the text in the arena
+	byte length;
+} TextEntry;
 
 struct str_hash_
 {
-	TextNodePtr Root[256];
-	word		LastID;
+	word*		Slots;		// Open addressing table of indices into Entries
+	word		SlotMask;	// Number of slots - 1
+	TextEntry*	Entries;	// Dense id -> entry table
+	word		EntryCount;
+	word		EntryCapacity;
+	word		NextTemp;	// Next temporary id, ids above it are taken
+	char*		Arena;		// Packed zero terminated texts
+	word		ArenaSize;
+	word		ArenaCapacity;
 };
 
-//static TextNodePtr Root[256];
-//static word LastID = 0;
+static byte grow_buffer(void** buffer, word used, word new_size)
+{
+	byte* res = (byte*)allocate(new_size);
+	if (!res) return 0;
+	if (*buffer)
+	{
+		memcpy(res, *buffer, used);
+		release(*buffer);
+	}
+	*buffer = res;
+	return 1;
+}
 
-static word allocate_id(StrHash* sh)
+// Append an entry for the next id.  Returns 0 on allocation failure
+// or when the id range is exhausted
+static TextEntry* allocate_entry(StrHash* sh)
 {
-	return ++sh->LastID;
+	if (sh->EntryCount >= sh->NextTemp) return 0;
+	if (sh->EntryCount >= sh->EntryCapacity)
+	{
+		word capacity = sh->EntryCapacity ? (sh->EntryCapacity << 1) : 32;
+		if (!grow_buffer((void**)&sh->Entries, sh->EntryCount * sizeof(TextEntry),
+			capacity * sizeof(TextEntry))) return 0;
+		sh->EntryCapacity = capacity;
+	}
+	TextEntry* entry = &sh->Entries[sh->EntryCount++];
+	return entry;
 }
 
-static void destroy_node(TextNodePtr ptr)
+static word* new_slots(word count)
 {
-	if (!ptr) return;
-	destroy_node(ptr->next);
-	release(ptr);
+	word* slots = (word*)allocate(count * sizeof(word));
+	if (slots)
+	{
+		for (word i = 0; i < count; ++i)
+			slots[i] = EMPTY_SLOT;
+	}
+	return slots;
+}
+
+// Double the slot table and re-insert all entries using their stored hash
+static byte rehash(StrHash* sh)
+{
+	word count = (sh->SlotMask + 1) << 1;
+	word* slots = new_slots(count);
+	if (!slots) return 0;
+	word mask = count - 1;
+	for (word i = 0; i < sh->EntryCount; ++i)
+	{
+		word pos = sh->Entries[i].hash & mask;
+		while (slots[pos] != EMPTY_SLOT)
+			pos = (pos + 1) & mask;
+		slots[pos] = i;
+	}
+	release(sh->Slots);
+	sh->Slots = slots;
+	sh->SlotMask = mask;
+	STAT_INC(strhash_rehashes);
+	return 1;
+}
+
+static byte add_text(StrHash* sh, TextEntry* entry, const char* text)
+{
+	byte length = 0;
+	while (text[length] && length < (MAX_LENGTH - 1)) ++length;
+	if ((sh->ArenaSize + length + 1) > sh->ArenaCapacity)
+	{
+		word capacity = sh->ArenaCapacity << 1;
+		if (!grow_buffer((void**)&sh->Arena, sh->ArenaSize, capacity)) return 0;
+		sh->ArenaCapacity = capacity;
+	}
+	entry->text = sh->ArenaSize;
+	entry->length = length;
+	memcpy(sh->Arena + entry->text, text, length);
+	sh->Arena[entry->text + length] = 0;
+	sh->ArenaSize += length + 1;
+	return 1;
 }
 
 StrHash* sh_init()
 {
 	StrHash* sh = (StrHash*)allocate(sizeof(StrHash));
-	sh->LastID = 0;
-	for (word i = 0; i < 256; ++i)
-		sh->Root[i] = 0;
+	sh->Slots = new_slots(INITIAL_SLOTS);
+	sh->SlotMask = INITIAL_SLOTS - 1;
+	sh->Entries = 0;
+	sh->EntryCount = 0;
+	sh->EntryCapacity = 0;
+	sh->NextTemp = FIRST_TEMP;
+	sh->Arena = (char*)allocate(INITIAL_ARENA);
+	sh->ArenaSize = 0;
+	sh->ArenaCapacity = INITIAL_ARENA;
 	return sh;
 }
 
 void sh_shut(StrHash* sh)
 {
-	for (word i = 0; i < 256; ++i)
-	{
-		destroy_node(sh->Root[i]);
-		sh->Root[i] = 0;
-	}
+	release(sh->Arena);
+	release(sh->Entries);
+	release(sh->Slots);
 	release(sh);
 }
 
 word sh_get(StrHash* sh, const char* text)
 {
-	byte sum = checksum(text);
-	TextNodePtr next = sh->Root[sum];
-	if (next)
+	word hash = hash_text(text);
+	word pos = hash & sh->SlotMask;
+	STAT_LOCAL(probes);
+	STAT_INC(strhash_lookups);
+	while (sh->Slots[pos] != EMPTY_SLOT)
 	{
-		for (TextNodePtr cur = next; cur; cur = cur->next)
+		word index = sh->Slots[pos];
+		TextEntry* entry = &sh->Entries[index];
+		if (entry->hash == hash && compare_n(text, sh->Arena + entry->text, MAX_LENGTH - 1) == 0)
 		{
-			if (compare_n(text, cur->text, MAX_LENGTH) == 0) return cur->id;
+			STAT_ADD(strhash_probes, probes);
+			STAT_MAX(strhash_max_probes, probes);
+			return index + 1;
 		}
+		STAT_STEP(probes);
+		pos = (pos + 1) & sh->SlotMask;
+	}
+	STAT_ADD(strhash_probes, probes);
+	STAT_MAX(strhash_max_probes, probes);
+	// Keep the load factor at or below 1/2 so probe sequences stay short
+	if (((sh->EntryCount + 1) << 1) > (sh->SlotMask + 1))
+	{
+		if (!rehash(sh)) return 0;
+		pos = hash & sh->SlotMask;
+		while (sh->Slots[pos] != EMPTY_SLOT)
+			pos = (pos + 1) & sh->SlotMask;
 	}
-	sh->Root[sum] = allocate(sizeof(TextNode));
-	sh->Root[sum]->id = allocate_id(sh);
-	copy_n(sh->Root[sum]->text, text, MAX_LENGTH);
-	sh->Root[sum]->next = next;
-	return sh->Root[sum]->id;
+	TextEntry* entry = allocate_entry(sh);
+	if (!entry) return 0;
+	entry->hash = hash;
+	if (!add_text(sh, entry, text)) return 0;
+	sh->Slots[pos] = sh->EntryCount - 1;
+	return sh->EntryCount;
+}
+
+const char* sh_view(StrHash* sh, word id, byte* length)
+{
+	if (id == 0 || id > sh->EntryCount) return 0;
+	TextEntry* entry = &sh->Entries[id - 1];
+	if (length) *length = entry->length;
+	return sh->Arena + entry->text;
 }
 
 byte sh_text(StrHash* sh, char* text, word id)
 {
-	for (word i = 0; i < 256; ++i)
-	{
-		TextNodePtr ptr = sh->Root[i];
-		while (ptr)
-		{
-			if (ptr->id == id)
-			{
-				copy_n(text, ptr->text, MAX_LENGTH);
-				return 1;
-			}
-			ptr = ptr->next;
-		}
-	}
-	return 0;
+	const char* view = sh_view(sh, id, 0);
+	if (!view) return 0;
+	copy_n(text, view, MAX_LENGTH);
+	return 1;
 }
 
 word sh_temp(StrHash* sh)
 {
-	return allocate_id(sh);
+	if (sh->NextTemp <= sh->EntryCount) return 0;
+	return sh->NextTemp--;
 }
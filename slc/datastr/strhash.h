@@ -18,3 +18,7 @@ word sh_temp(StrHash* sh);
 
 // Retrieve the text associated with a hash
 byte sh_text(StrHash* sh, char* text, word hash);
+
+// Zero copy access to the text associated with a hash.
+// Returns 0 for unknown or temporary hashes.  length is optional
+const char* sh_view(StrHash* sh, word hash, byte* length);
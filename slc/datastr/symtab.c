@@ -0,0 +1,182 @@
+#include "symtab.h"
+#include "vector.h"
+#include "memory.h"
+#include "stats.h"
+
+#define INITIAL_SLOTS 8		// Must be a power of 2
+#define EMPTY_NAME 0
+#define NO_VALUE 0xFFFF
+#define SCOPE_MARK 0			// Name of the log entry that opens a scope
+
+typedef struct sym_entry_
+{
+	word name;
+	word value;
+} SymEntry;
+
+struct sym_tab_
+{
+	SymEntry*	slots;
+	word		mask;		// Number of slots - 1
+	word		count;
+	byte		depth;		// Scope nesting depth
+	Vector*		log;		// Replaced values, for restoring when a scope is left
+};
+
+static SymEntry* new_slots(word count)
+{
+	SymEntry* slots = (SymEntry*)allocate(count * sizeof(SymEntry));
+	if (slots)
+	{
+		for (word i = 0; i < count; ++i)
+			slots[i].name = EMPTY_NAME;
+	}
+	return slots;
+}
+
+// Ids are sequential, mix the bits so neighbouring ids spread out
+static word slot_of(word name, word mask)
+{
+	word h = name ^ (name << 7);
+	h ^= (h >> 5);
+	return h & mask;
+}
+
+static word find_slot(SymTab* t, word name)
+{
+	word pos = slot_of(name, t->mask);
+	STAT_LOCAL(probes);
+	while (t->slots[pos].name != EMPTY_NAME && t->slots[pos].name != name)
+	{
+		STAT_STEP(probes);
+		pos = (pos + 1) & t->mask;
+	}
+	STAT_ADD(symtab_probes, probes);
+	STAT_MAX(symtab_max_probes, probes);
+	return pos;
+}
+
+static byte grow(SymTab* t)
+{
+	word count = (t->mask + 1) << 1;
+	SymEntry* slots = new_slots(count);
+	if (!slots) return 0;
+	SymEntry* old = t->slots;
+	word old_count = t->mask + 1;
+	t->slots = slots;
+	t->mask = count - 1;
+	for (word i = 0; i < old_count; ++i)
+	{
+		if (old[i].name != EMPTY_NAME)
+			t->slots[find_slot(t, old[i].name)] = old[i];
+	}
+	release(old);
+	return 1;
+}
+
+// Backward shift deletion, keeps probe sequences intact without tombstones
+static void remove_slot(SymTab* t, word pos)
+{
+	word next = (pos + 1) & t->mask;
+	while (t->slots[next].name != EMPTY_NAME)
+	{
+		word home = slot_of(t->slots[next].name, t->mask);
+		// Move the entry back if its home is not in (pos, next]
+		if (((next - home) & t->mask) >= ((next - pos) & t->mask))
+		{
+			t->slots[pos] = t->slots[next];
+			pos = next;
+		}
+		next = (next + 1) & t->mask;
+	}
+	t->slots[pos].name = EMPTY_NAME;
+	--t->count;
+}
+
+SymTab* symtab_new()
+{
+	SymTab* t = (SymTab*)allocate(sizeof(SymTab));
+	if (!t) return 0;
+	t->slots = new_slots(INITIAL_SLOTS);
+	t->mask = INITIAL_SLOTS - 1;
+	t->count = 0;
+	t->depth = 0;
+	t->log = vector_new(sizeof(SymEntry));
+	return t;
+}
+
+void symtab_shut(SymTab* t)
+{
+	if (!t) return;
+	vector_shut(t->log);
+	release(t->slots);
+	release(t);
+}
+
+byte symtab_get(SymTab* t, word name, word* value)
+{
+	STAT_INC(symtab_lookups);
+	SymEntry* e = &t->slots[find_slot(t, name)];
+	if (e->name == EMPTY_NAME) return 0;
+	if (value) *value = e->value;
+	return 1;
+}
+
+byte symtab_set(SymTab* t, word name, word value)
+{
+	STAT_INC(symtab_lookups);
+	word pos = find_slot(t, name);
+	SymEntry* e = &t->slots[pos];
+	if (t->depth > 0)
+	{
+		SymEntry undo = { name, (e->name == EMPTY_NAME ? NO_VALUE : e->value) };
+		if (!vector_push(t->log, &undo)) return 0;
+	}
+	if (e->name == EMPTY_NAME)
+	{
+		// Keep the load factor at or below 3/4.  The tables hold every label
+		// of the program, so a sparser table costs more heap than it saves
+		if ((t->count + 1) > (t->mask + 1) - ((t->mask + 1) >> 2))
+		{
+			if (!grow(t)) return 0;
+			pos = find_slot(t, name);
+			e = &t->slots[pos];
+		}
+		e->name = name;
+		++t->count;
+	}
+	e->value = value;
+	return 1;
+}
+
+byte symtab_push(SymTab* t)
+{
+	SymEntry mark = { SCOPE_MARK, 0 };
+	if (!vector_push(t->log, &mark)) return 0;
+	++t->depth;
+	return 1;
+}
+
+void symtab_pop(SymTab* t)
+{
+	if (t->depth == 0) return;
+	SymEntry undo;
+	while (vector_pop(t->log, &undo))
+	{
+		if (undo.name == SCOPE_MARK) break;
+		word pos = find_slot(t, undo.name);
+		if (undo.value == NO_VALUE)
+		{
+			if (t->slots[pos].name != EMPTY_NAME)
+				remove_slot(t, pos);
+		}
+		else
+			t->slots[pos].value = undo.value;
+	}
+	--t->depth;
+}
+
+word symtab_size(SymTab* t)
+{
+	return t->count;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "types.h"
+
+// Hash table from interned names (StrHash ids, never 0) to word values
+// (0xFFFF is reserved), with nested scopes.  Values set inside a scope
+// are undone when it is left.
+typedef struct sym_tab_ SymTab;
+
+SymTab*		symtab_new();
+void		symtab_shut(SymTab*);
+
+// Returns 1 and the value if name is present
+byte		symtab_get(SymTab*, word name, word* value);
+
+// Add or overwrite a value.  Returns 0 on allocation failure
+byte		symtab_set(SymTab*, word name, word value);
+
+// Enter a scope
+byte		symtab_push(SymTab*);
+
+// Leave the innermost scope, restoring the values it replaced
+void		symtab_pop(SymTab*);
+
+// Number of names in the table
+word		symtab_size(SymTab*);
@@ -1,5 +1,6 @@
 #include "dev.h"
 #include "datastr/strhash.h"
+#include "keywords.h"
 
 extern StrHash* texts;
 
@@ -21,24 +22,20 @@ void print_indent(int indent)
 
 void print_type(byte var_type)
 {
-	switch (var_type)
+	const char* text = kw_text(var_type);
+	if (!text)
 	{
-	case BYTE: fprintf(output,"byte"); break;
-	case SBYTE: fprintf(output,"sbyte"); break;
-	case WORD: fprintf(output,"word"); break;
-	case SWORD: fprintf(output,"sword"); break;
-	default:
 		fprintf(output,"Unknown");
 		exit(1);
 	}
+	fprintf(output,"%s", text);
 }
 
 void print_name(word id)
 {
-	char name[20];
-	name[16] = 0;
-	sh_text(texts, name, id);
-	fprintf(output,"%s", name);
+	const char* name = sh_view(texts, id, 0);
+	if (name)
+		fprintf(output,"%s", name);
 }
 
 void print_array(Node* node)
@@ -71,6 +68,7 @@ void print_var(Node* node)
 
 void print_fun(Node* node)
 {
+	if (node->type == FAST) fprintf(output,"fast ");
 	fprintf(output,"fun ");
 	print_name(node->name);
 	fprintf(output,"(");
@@ -147,6 +145,9 @@ void print_expression(Node* node)
 		PRINT_OPER(AMP, &);
 		PRINT_OPER(PIPE, | );
 		PRINT_OPER(CARET, ^);
+		PRINT_OPER(STAR, *);
+		PRINT_OPER(SLASH, / );
+		PRINT_OPER(PERCENT, %%);
 	default:
 		print_value(node);
 	}
@@ -198,7 +199,8 @@ void dev_print_tree_node(Node* node, int indent)
 	switch (node->type)
 	{
 	case ROOT:	print_indent(indent); fprintf(output,"ROOT\n"); break;
-	case FUN:	print_indent(indent); print_fun(node); break;
+	case FUN:
+	case FAST:	print_indent(indent); print_fun(node); break;
 	case STRUCT:print_indent(indent); fprintf(output,"struct "); print_name(node->name); fprintf(output,"\n"); break;
 	case VAR:	print_indent(indent); fprintf(output,"var "); print_base_type(&node->data_type, node->parameters); fprintf(output," "); print_name(node->name); fprintf(output,"\n"); break;
 	case ASSIGN:print_indent(indent); print_assign(node); break;
@@ -233,7 +235,7 @@ void print_tree_nodes(Node* node, int indent)
 		else
 		{
 			print_tree_nodes(node->child, indent + 2);
-			if (node->type == FUN || node->type == IF ||
+			if (node->type == FUN || node->type == FAST || node->type == IF ||
 				node->type == WHILE || node->type == STRUCT)
 			{
 				print_indent(indent);
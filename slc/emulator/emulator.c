@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "z80.h"
+#include "services.h"
+
+// Runs a compiled program (out.bin) on the Z80 core.
+// The image is loaded at LOAD_ADDRESS and entered with a return
+// address of 0, so returning from main ends the run.  OS services
+// (RST 08h, A=service) are handled here, then the call returns.
+
+#define LOAD_ADDRESS 0x1000
+#define SERVICE_ENTRY 0x0008
+#define EXIT_ADDRESS 0x0000
+#define SERVICE_RETURN_TSTATES 10	// The RET at the end of the OS handler
+#define TSTATES_PER_MS 4000			// 4MHz
+
+typedef enum { RUN_ACTIVE, RUN_MAIN_RETURNED, RUN_HALTED, RUN_LIMIT, RUN_BOUNDS, RUN_BAD_SERVICE } RunState;
+
+static const char* state_names[] = { "active", "main", "halt", "limit", "bounds", "service" };
+
+static byte memory[0x10000];
+static Z80 cpu;
+static RunState state = RUN_ACTIVE;
+static FILE* gpu = 0;
+static FILE* file = 0;
+static const char* input_keys = "";
+static unsigned long rng_state = 1;
+static unsigned long long service_tstates = 0;
+static unsigned long services_called = 0;
+
+static word text_length(word addr)
+{
+	word n = 0;
+	while (memory[(word)(addr + n)] && n < 0xFFFF) ++n;
+	return n;
+}
+
+static void print_text(word addr)
+{
+	for (; memory[addr]; ++addr)
+		putchar(memory[addr]);
+}
+
+static byte compare_text(word a, word b, word limit)
+{
+	for (word i = 0; i < limit; ++i, ++a, ++b)
+	{
+		if (memory[a] != memory[b]) return memory[a] < memory[b] ? 0xFF : 1;
+		if (memory[a] == 0) break;
+	}
+	return 0;
+}
+
+// The OS keeps a single open file
+static word open_file(word name_addr)
+{
+	char name[256];
+	word n = 0;
+	for (; memory[(word)(name_addr + n)] && n < 255; ++n)
+		name[n] = memory[(word)(name_addr + n)];
+	name[n] = 0;
+	if (file) fclose(file);
+	file = fopen(name, "rb");
+	return file ? 1 : 0;
+}
+
+static void service()
+{
+	word hl = z80_hl(&cpu);
+	word de = z80_de(&cpu);
+	word res = hl;
+	++services_called;
+	switch (cpu.a)
+	{
+	case SERVICE_CLS:
+		if (gpu) fputc(0, gpu);
+		break;
+	case SERVICE_PRINT_TEXT: print_text(hl); break;
+	case SERVICE_PRINT_WORD: printf("%u", hl); break;
+	case SERVICE_NEWLINE: putchar('\n'); break;
+	case SERVICE_STRLEN: res = text_length(hl); break;
+	case SERVICE_STRCMP: cpu.a = compare_text(hl, de, 0xFFFF); break;
+	case SERVICE_STRNCMP: cpu.a = compare_text(hl, de, cpu.b); break;
+	case SERVICE_INPUT_EMPTY: cpu.a = *input_keys ? 0 : 1; break;
+	case SERVICE_INPUT_READ:
+		cpu.a = *input_keys;
+		if (*input_keys) ++input_keys;
+		break;
+	case SERVICE_RNG:
+		// Fixed seed LCG so runs are reproducible
+		rng_state = rng_state * 1103515245 + 12345;
+		res = (word)(rng_state >> 16);
+		break;
+	case SERVICE_GPU_BLOCK:
+		// First byte is the number of bytes that follow
+		if (gpu) fwrite(&memory[(word)(hl + 1)], 1, memory[hl], gpu);
+		break;
+	case SERVICE_GPU_BYTE:
+		if (gpu) fputc(cpu.l, gpu);
+		break;
+	case SERVICE_GPU_FLUSH:
+		if (gpu) fflush(gpu);
+		break;
+	case SERVICE_TIMER:
+		res = (word)(cpu.tstates / TSTATES_PER_MS);
+		break;
+	case SERVICE_LIST_DIR:
+	case SERVICE_LIST_NEXT:
+		res = 0;
+		break;
+	case SERVICE_OPEN_FILE: res = open_file(hl); break;
+	case SERVICE_READ_FILE:
+		// HL=buffer, DE=size.  Returns the number of bytes read
+		res = 0;
+		if (file) res = (word)fread(&memory[hl], 1, de > (0x10000 - hl) ? (0x10000 - hl) : de, file);
+		break;
+	case SERVICE_CLOSE_FILE:
+		if (file) fclose(file);
+		file = 0;
+		break;
+	case SERVICE_BOUNDS_CHECK:
+		// HL=index, DE=length
+		if (hl >= de)
+		{
+			fprintf(stderr, "Index %u out of bounds (%u) at 0x%04X\n", hl, de, z80_pop(&cpu) - 3);
+			state = RUN_BOUNDS;
+			return;
+		}
+		break;
+	default:
+		fprintf(stderr, "Unknown service %d\n", cpu.a);
+		state = RUN_BAD_SERVICE;
+		return;
+	}
+	z80_set_hl(&cpu, res);
+	cpu.pc = z80_pop(&cpu);
+	cpu.tstates += SERVICE_RETURN_TSTATES;
+	service_tstates += SERVICE_RETURN_TSTATES;
+}
+
+static int load(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open %s\n", filename);
+		return -1;
+	}
+	size_t n = fread(&memory[LOAD_ADDRESS], 1, sizeof(memory) - LOAD_ADDRESS, f);
+	fclose(f);
+	return (int)n;
+}
+
+static void dump(const char* spec)
+{
+	unsigned addr = 0, len = 0;
+	if (sscanf(spec, "%x:%u", &addr, &len) != 2) return;
+	printf("dump %04X", addr);
+	for (unsigned i = 0; i < len; ++i)
+		printf(" %02X", memory[(word)(addr + i)]);
+	printf("\n");
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: z80emu [options] out.bin\n");
+	fprintf(stderr, "  -t <tstates>   Stop after this many T-states\n");
+	fprintf(stderr, "  -g <file>      Write the GPU command stream to file\n");
+	fprintf(stderr, "  -k <keys>      Keys returned by input_read\n");
+	fprintf(stderr, "  -d <addr:len>  Dump memory (hex address) after the run\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long long limit = 0;
+	const char* gpu_filename = 0;
+	const char* binary = 0;
+	const char* dumps[16];
+	int dump_count = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (argv[i][0] == '-' && (i + 1) < argc)
+		{
+			switch (argv[i][1])
+			{
+			case 't': limit = strtoull(argv[++i], 0, 10); break;
+			case 'g': gpu_filename = argv[++i]; break;
+			case 'k': input_keys = argv[++i]; break;
+			case 'd': if (dump_count < 16) dumps[dump_count++] = argv[++i]; else ++i; break;
+			default: usage();
+			}
+		}
+		else
+		if (argv[i][0] == '-') usage();
+		else binary = argv[i];
+	}
+	if (!binary) usage();
+
+	int size = load(binary);
+	if (size < 0) return 1;
+	if (gpu_filename)
+	{
+		gpu = fopen(gpu_filename, "wb");
+		if (!gpu)
+		{
+			fprintf(stderr, "Failed to create %s\n", gpu_filename);
+			return 1;
+		}
+	}
+
+	z80_reset(&cpu, memory);
+	cpu.sp = 0;
+	z80_push(&cpu, EXIT_ADDRESS);
+	word stack_top = cpu.sp;
+	word stack_low = cpu.sp;
+	cpu.pc = LOAD_ADDRESS;
+	while (state == RUN_ACTIVE)
+	{
+		z80_step(&cpu);
+		if (cpu.pc == EXIT_ADDRESS)
+		{
+			state = RUN_MAIN_RETURNED;
+			break;
+		}
+		if (cpu.sp < stack_low) stack_low = cpu.sp;
+		if (cpu.pc == SERVICE_ENTRY) service();
+		else
+		if (cpu.halted) state = RUN_HALTED;
+		if (limit && cpu.tstates >= limit && state == RUN_ACTIVE) state = RUN_LIMIT;
+	}
+	if (gpu) fclose(gpu);
+	if (file) fclose(file);
+
+	printf("exit %s\n", state_names[state]);
+	printf("size %d\n", size);
+	printf("tstates %llu\n", cpu.tstates);
+	printf("service_tstates %llu\n", service_tstates);
+	printf("instructions %llu\n", cpu.instructions);
+	printf("services %lu\n", services_called);
+	printf("stack %u\n", (unsigned)(stack_top - stack_low));
+	printf("hl %u\n", z80_hl(&cpu));
+	printf("a %u\n", cpu.a);
+	for (int i = 0; i < dump_count; ++i)
+		dump(dumps[i]);
+	return (state == RUN_MAIN_RETURNED || state == RUN_LIMIT) ? 0 : 2;
+}
@@ -0,0 +1,788 @@
+#include "z80.h"
+
+#define RD(a) (cpu->memory[(word)(a)])
+#define WR(a, v) cpu->memory[(word)(a)] = (byte)(v)
+
+static byte szp_table[256];		// S, Z, X, Y and parity of a byte
+static byte tables_ready = 0;
+
+static void init_tables()
+{
+	for (int i = 0; i < 256; ++i)
+	{
+		byte p = 1;
+		for (int j = 0; j < 8; ++j)
+			if (i & (1 << j)) p ^= 1;
+		szp_table[i] = (i & (FLAG_S | FLAG_X | FLAG_Y)) | (i == 0 ? FLAG_Z : 0) | (p ? FLAG_PV : 0);
+	}
+	tables_ready = 1;
+}
+
+#define SZ(v)  (szp_table[(byte)(v)] & ~FLAG_PV)
+#define SZP(v) (szp_table[(byte)(v)])
+
+word z80_bc(Z80* cpu) { return (cpu->b << 8) | cpu->c; }
+word z80_de(Z80* cpu) { return (cpu->d << 8) | cpu->e; }
+word z80_hl(Z80* cpu) { return (cpu->h << 8) | cpu->l; }
+void z80_set_hl(Z80* cpu, word value) { cpu->h = value >> 8; cpu->l = value & 0xFF; }
+
+static byte fetch(Z80* cpu)
+{
+	return RD(cpu->pc++);
+}
+
+static word fetch_word(Z80* cpu)
+{
+	word lo = fetch(cpu);
+	return lo | (fetch(cpu) << 8);
+}
+
+static word read_word(Z80* cpu, word addr)
+{
+	return RD(addr) | (RD(addr + 1) << 8);
+}
+
+static void write_word(Z80* cpu, word addr, word value)
+{
+	WR(addr, value & 0xFF);
+	WR(addr + 1, value >> 8);
+}
+
+void z80_push(Z80* cpu, word value)
+{
+	cpu->sp -= 2;
+	write_word(cpu, cpu->sp, value);
+}
+
+word z80_pop(Z80* cpu)
+{
+	word value = read_word(cpu, cpu->sp);
+	cpu->sp += 2;
+	return value;
+}
+
+static void inc_r(Z80* cpu)
+{
+	cpu->r = (cpu->r & 0x80) | ((cpu->r + 1) & 0x7F);
+}
+
+void z80_reset(Z80* cpu, byte* memory)
+{
+	if (!tables_ready) init_tables();
+	cpu->a = cpu->f = cpu->b = cpu->c = cpu->d = cpu->e = cpu->h = cpu->l = 0;
+	cpu->a_ = cpu->f_ = cpu->b_ = cpu->c_ = cpu->d_ = cpu->e_ = cpu->h_ = cpu->l_ = 0;
+	cpu->ix = cpu->iy = 0;
+	cpu->sp = 0xFFFF;
+	cpu->pc = 0;
+	cpu->i = cpu->r = cpu->iff1 = cpu->iff2 = cpu->im = 0;
+	cpu->halted = 0;
+	cpu->tstates = 0;
+	cpu->instructions = 0;
+	cpu->memory = memory;
+	cpu->in = 0;
+	cpu->out = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Register pair access by encoding
+/////////////////////////////////////////////////////////////////////
+
+// rp table: BC, DE, HL/IX/IY, SP
+static word get_rp(Z80* cpu, byte p, word* index)
+{
+	switch (p)
+	{
+	case 0: return z80_bc(cpu);
+	case 1: return z80_de(cpu);
+	case 2: return index ? *index : z80_hl(cpu);
+	default: return cpu->sp;
+	}
+}
+
+static void set_rp(Z80* cpu, byte p, word value, word* index)
+{
+	switch (p)
+	{
+	case 0: cpu->b = value >> 8; cpu->c = value & 0xFF; break;
+	case 1: cpu->d = value >> 8; cpu->e = value & 0xFF; break;
+	case 2: if (index) *index = value; else z80_set_hl(cpu, value); break;
+	default: cpu->sp = value; break;
+	}
+}
+
+// rp2 table: BC, DE, HL/IX/IY, AF
+static word get_rp2(Z80* cpu, byte p, word* index)
+{
+	if (p == 3) return (cpu->a << 8) | cpu->f;
+	return get_rp(cpu, p, index);
+}
+
+static void set_rp2(Z80* cpu, byte p, word value, word* index)
+{
+	if (p == 3) { cpu->a = value >> 8; cpu->f = value & 0xFF; }
+	else set_rp(cpu, p, value, index);
+}
+
+// 8 bit registers: B C D E H L (HL) A.  With an index prefix, H and L
+// refer to the index halves.  Register 6 is handled by the caller.
+static byte get_r(Z80* cpu, byte r, word* index)
+{
+	switch (r)
+	{
+	case 0: return cpu->b;
+	case 1: return cpu->c;
+	case 2: return cpu->d;
+	case 3: return cpu->e;
+	case 4: return index ? (*index >> 8) : cpu->h;
+	case 5: return index ? (*index & 0xFF) : cpu->l;
+	default: return cpu->a;
+	}
+}
+
+static void set_r(Z80* cpu, byte r, byte value, word* index)
+{
+	switch (r)
+	{
+	case 0: cpu->b = value; break;
+	case 1: cpu->c = value; break;
+	case 2: cpu->d = value; break;
+	case 3: cpu->e = value; break;
+	case 4: if (index) *index = (*index & 0x00FF) | (value << 8); else cpu->h = value; break;
+	case 5: if (index) *index = (*index & 0xFF00) | value; else cpu->l = value; break;
+	default: cpu->a = value; break;
+	}
+}
+
+static byte condition(Z80* cpu, byte y)
+{
+	switch (y)
+	{
+	case 0: return !(cpu->f & FLAG_Z);
+	case 1: return (cpu->f & FLAG_Z) != 0;
+	case 2: return !(cpu->f & FLAG_C);
+	case 3: return (cpu->f & FLAG_C) != 0;
+	case 4: return !(cpu->f & FLAG_PV);
+	case 5: return (cpu->f & FLAG_PV) != 0;
+	case 6: return !(cpu->f & FLAG_S);
+	default: return (cpu->f & FLAG_S) != 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// ALU
+/////////////////////////////////////////////////////////////////////
+
+static void alu(Z80* cpu, byte op, byte v)
+{
+	byte a = cpu->a;
+	word res;
+	switch (op)
+	{
+	case 0: // ADD
+	case 1: // ADC
+		res = a + v + (op == 1 ? (cpu->f & FLAG_C) : 0);
+		cpu->f = SZ(res) | ((a ^ v ^ res) & FLAG_H) |
+			(((a ^ ~v) & (a ^ res) & 0x80) ? FLAG_PV : 0) | ((res >> 8) & FLAG_C);
+		cpu->a = (byte)res;
+		break;
+	case 2: // SUB
+	case 3: // SBC
+	case 7: // CP
+		res = a - v - (op == 3 ? (cpu->f & FLAG_C) : 0);
+		cpu->f = (SZ(res) & ~(FLAG_X | FLAG_Y)) | FLAG_N | ((a ^ v ^ res) & FLAG_H) |
+			(((a ^ v) & (a ^ res) & 0x80) ? FLAG_PV : 0) | ((res >> 8) & FLAG_C);
+		if (op == 7) cpu->f |= v & (FLAG_X | FLAG_Y);
+		else
+		{
+			cpu->f |= res & (FLAG_X | FLAG_Y);
+			cpu->a = (byte)res;
+		}
+		break;
+	case 4: // AND
+		cpu->a &= v;
+		cpu->f = SZP(cpu->a) | FLAG_H;
+		break;
+	case 5: // XOR
+		cpu->a ^= v;
+		cpu->f = SZP(cpu->a);
+		break;
+	default: // OR
+		cpu->a |= v;
+		cpu->f = SZP(cpu->a);
+		break;
+	}
+}
+
+static byte inc8(Z80* cpu, byte v)
+{
+	byte res = v + 1;
+	cpu->f = (cpu->f & FLAG_C) | SZ(res) | ((v & 0x0F) == 0x0F ? FLAG_H : 0) | (v == 0x7F ? FLAG_PV : 0);
+	return res;
+}
+
+static byte dec8(Z80* cpu, byte v)
+{
+	byte res = v - 1;
+	cpu->f = (cpu->f & FLAG_C) | FLAG_N | SZ(res) | ((v & 0x0F) == 0 ? FLAG_H : 0) | (v == 0x80 ? FLAG_PV : 0);
+	return res;
+}
+
+static word add16(Z80* cpu, word a, word b)
+{
+	unsigned res = a + b;
+	cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | ((res >> 8) & (FLAG_X | FLAG_Y)) |
+		(((a ^ b ^ res) >> 8) & FLAG_H) | ((res >> 16) & FLAG_C);
+	return (word)res;
+}
+
+static word adc16(Z80* cpu, word a, word b)
+{
+	unsigned res = a + b + (cpu->f & FLAG_C);
+	cpu->f = ((res >> 8) & (FLAG_S | FLAG_X | FLAG_Y)) | ((res & 0xFFFF) ? 0 : FLAG_Z) |
+		(((a ^ b ^ res) >> 8) & FLAG_H) | (((a ^ ~b) & (a ^ res) & 0x8000) ? FLAG_PV : 0) |
+		((res >> 16) & FLAG_C);
+	return (word)res;
+}
+
+static word sbc16(Z80* cpu, word a, word b)
+{
+	unsigned res = a - b - (cpu->f & FLAG_C);
+	cpu->f = FLAG_N | ((res >> 8) & (FLAG_S | FLAG_X | FLAG_Y)) | ((res & 0xFFFF) ? 0 : FLAG_Z) |
+		(((a ^ b ^ res) >> 8) & FLAG_H) | (((a ^ b) & (a ^ res) & 0x8000) ? FLAG_PV : 0) |
+		((res >> 16) & FLAG_C);
+	return (word)res;
+}
+
+// CB prefixed rotates and shifts
+static byte rot(Z80* cpu, byte op, byte v)
+{
+	byte c;
+	byte res;
+	switch (op)
+	{
+	case 0: c = v >> 7; res = (v << 1) | c; break;						// RLC
+	case 1: c = v & 1; res = (v >> 1) | (c << 7); break;				// RRC
+	case 2: c = v >> 7; res = (v << 1) | (cpu->f & FLAG_C); break;		// RL
+	case 3: c = v & 1; res = (v >> 1) | ((cpu->f & FLAG_C) << 7); break;	// RR
+	case 4: c = v >> 7; res = v << 1; break;							// SLA
+	case 5: c = v & 1; res = (v >> 1) | (v & 0x80); break;				// SRA
+	case 6: c = v >> 7; res = (v << 1) | 1; break;						// SLL
+	default: c = v & 1; res = v >> 1; break;							// SRL
+	}
+	cpu->f = SZP(res) | c;
+	return res;
+}
+
+static void daa(Z80* cpu)
+{
+	byte a = cpu->a;
+	byte correction = 0;
+	byte carry = cpu->f & FLAG_C;
+	if ((cpu->f & FLAG_H) || (a & 0x0F) > 9) correction |= 0x06;
+	if (carry || a > 0x99)
+	{
+		correction |= 0x60;
+		carry = FLAG_C;
+	}
+	byte res;
+	byte half;
+	if (cpu->f & FLAG_N)
+	{
+		res = a - correction;
+		half = (cpu->f & FLAG_H) && (a & 0x0F) < 6 ? FLAG_H : 0;
+	}
+	else
+	{
+		res = a + correction;
+		half = (a & 0x0F) > 9 ? FLAG_H : 0;
+	}
+	cpu->a = res;
+	cpu->f = SZP(res) | (cpu->f & FLAG_N) | half | carry;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Prefixed groups
+/////////////////////////////////////////////////////////////////////
+
+// CB group.  For DD CB / FD CB the operand is (index+d) and the
+// result is also copied into register z when z != 6.
+static int exec_cb(Z80* cpu, word* index, word addr)
+{
+	byte op = index ? RD(cpu->pc++) : fetch(cpu);
+	if (!index) inc_r(cpu);
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	byte memory_operand = index || z == 6;
+	if (!index) addr = z80_hl(cpu);
+	byte v = memory_operand ? RD(addr) : get_r(cpu, z, 0);
+	switch (x)
+	{
+	case 0:
+		v = rot(cpu, y, v);
+		break;
+	case 1:
+	{
+		byte set = v & (1 << y);
+		cpu->f = (cpu->f & FLAG_C) | FLAG_H | (set ? 0 : (FLAG_Z | FLAG_PV)) | (y == 7 && set ? FLAG_S : 0);
+		cpu->f |= (memory_operand ? (addr >> 8) : v) & (FLAG_X | FLAG_Y);
+		if (index) return 20;
+		return z == 6 ? 12 : 8;
+	}
+	case 2: v &= ~(1 << y); break;
+	default: v |= (1 << y); break;
+	}
+	if (memory_operand)
+	{
+		WR(addr, v);
+		if (index && z != 6) set_r(cpu, z, v, 0);
+		return index ? 23 : 15;
+	}
+	set_r(cpu, z, v, 0);
+	return 8;
+}
+
+static int block_op(Z80* cpu, byte y, byte z)
+{
+	word hl = z80_hl(cpu);
+	word bc = z80_bc(cpu);
+	word de = z80_de(cpu);
+	signed char dir = (y & 1) ? -1 : 1;
+	byte repeat = y >= 6;
+	byte again = 0;
+	switch (z)
+	{
+	case 0: // LDI/LDD/LDIR/LDDR
+	{
+		byte v = RD(hl);
+		WR(de, v);
+		hl += dir; de += dir; --bc;
+		byte n = v + cpu->a;
+		cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_C)) | (bc ? FLAG_PV : 0) | (n & FLAG_X) | ((n << 4) & FLAG_Y);
+		again = repeat && bc != 0;
+		break;
+	}
+	case 1: // CPI/CPD/CPIR/CPDR
+	{
+		byte v = RD(hl);
+		byte res = cpu->a - v;
+		hl += dir; --bc;
+		byte half = (cpu->a ^ v ^ res) & FLAG_H;
+		byte n = res - (half ? 1 : 0);
+		cpu->f = (cpu->f & FLAG_C) | FLAG_N | (SZ(res) & ~(FLAG_X | FLAG_Y)) | half |
+			(bc ? FLAG_PV : 0) | (n & FLAG_X) | ((n << 4) & FLAG_Y);
+		again = repeat && bc != 0 && res != 0;
+		break;
+	}
+	case 2: // INI/IND/INIR/INDR
+	{
+		byte v = cpu->in ? cpu->in(cpu, bc) : 0xFF;
+		WR(hl, v);
+		hl += dir;
+		cpu->b--;
+		bc = z80_bc(cpu);
+		cpu->f = SZ(cpu->b) | FLAG_N;
+		again = repeat && cpu->b != 0;
+		break;
+	}
+	default: // OUTI/OUTD/OTIR/OTDR
+	{
+		byte v = RD(hl);
+		cpu->b--;
+		bc = z80_bc(cpu);
+		if (cpu->out) cpu->out(cpu, bc, v);
+		hl += dir;
+		cpu->f = SZ(cpu->b) | FLAG_N;
+		again = repeat && cpu->b != 0;
+		break;
+	}
+	}
+	z80_set_hl(cpu, hl);
+	cpu->b = bc >> 8; cpu->c = bc & 0xFF;
+	cpu->d = de >> 8; cpu->e = de & 0xFF;
+	if (again)
+	{
+		cpu->pc -= 2;
+		return 21;
+	}
+	return 16;
+}
+
+static int exec_ed(Z80* cpu)
+{
+	byte op = fetch(cpu);
+	inc_r(cpu);
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	byte p = y >> 1, q = y & 1;
+	if (x == 2 && z <= 3 && y >= 4) return block_op(cpu, y, z);
+	if (x != 1) return 8;	// Invalid, acts as two NOPs
+	switch (z)
+	{
+	case 0: // IN r,(C)
+	{
+		byte v = cpu->in ? cpu->in(cpu, z80_bc(cpu)) : 0xFF;
+		if (y != 6) set_r(cpu, y, v, 0);
+		cpu->f = (cpu->f & FLAG_C) | SZP(v);
+		return 12;
+	}
+	case 1: // OUT (C),r
+		if (cpu->out) cpu->out(cpu, z80_bc(cpu), y == 6 ? 0 : get_r(cpu, y, 0));
+		return 12;
+	case 2:
+	{
+		word hl = z80_hl(cpu);
+		word rr = get_rp(cpu, p, 0);
+		z80_set_hl(cpu, q ? adc16(cpu, hl, rr) : sbc16(cpu, hl, rr));
+		return 15;
+	}
+	case 3:
+	{
+		word addr = fetch_word(cpu);
+		if (q) set_rp(cpu, p, read_word(cpu, addr), 0);
+		else write_word(cpu, addr, get_rp(cpu, p, 0));
+		return 20;
+	}
+	case 4: // NEG
+	{
+		byte v = cpu->a;
+		cpu->a = 0;
+		alu(cpu, 2, v);
+		return 8;
+	}
+	case 5: // RETN / RETI
+		cpu->iff1 = cpu->iff2;
+		cpu->pc = z80_pop(cpu);
+		return 14;
+	case 6: // IM
+		cpu->im = (y & 3) == 2 ? 1 : ((y & 3) == 3 ? 2 : 0);
+		return 8;
+	default:
+		switch (y)
+		{
+		case 0: cpu->i = cpu->a; return 9;
+		case 1: cpu->r = cpu->a; return 9;
+		case 2:
+		case 3:
+			cpu->a = y == 2 ? cpu->i : cpu->r;
+			cpu->f = (cpu->f & FLAG_C) | SZ(cpu->a) | (cpu->iff2 ? FLAG_PV : 0);
+			return 9;
+		case 4: // RRD
+		case 5: // RLD
+		{
+			word hl = z80_hl(cpu);
+			byte m = RD(hl);
+			if (y == 4)
+			{
+				WR(hl, (cpu->a << 4) | (m >> 4));
+				cpu->a = (cpu->a & 0xF0) | (m & 0x0F);
+			}
+			else
+			{
+				WR(hl, (m << 4) | (cpu->a & 0x0F));
+				cpu->a = (cpu->a & 0xF0) | (m >> 4);
+			}
+			cpu->f = (cpu->f & FLAG_C) | SZP(cpu->a);
+			return 18;
+		}
+		default:
+			return 8;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// Main decoder
+/////////////////////////////////////////////////////////////////////
+
+// Executes the unprefixed opcode table.  index is 0 for HL, or points
+// at IX/IY after a DD/FD prefix.
+static int exec_main(Z80* cpu, byte op, word* index)
+{
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	byte p = y >> 1, q = y & 1;
+	int extra = index ? 4 : 0;		// Prefix fetch
+
+	// Address of the (HL) / (index+d) memory operand
+#define MEM_ADDR() (index ? (word)(*index + (signed char)fetch(cpu)) : z80_hl(cpu))
+
+	switch (x)
+	{
+	case 0:
+		switch (z)
+		{
+		case 0:
+			switch (y)
+			{
+			case 0: return 4 + extra;	// NOP
+			case 1:	// EX AF,AF'
+			{
+				byte t = cpu->a; cpu->a = cpu->a_; cpu->a_ = t;
+				t = cpu->f; cpu->f = cpu->f_; cpu->f_ = t;
+				return 4 + extra;
+			}
+			case 2:	// DJNZ
+			{
+				signed char d = (signed char)fetch(cpu);
+				if (--cpu->b)
+				{
+					cpu->pc += d;
+					return 13 + extra;
+				}
+				return 8 + extra;
+			}
+			case 3:	// JR
+			{
+				signed char d = (signed char)fetch(cpu);
+				cpu->pc += d;
+				return 12 + extra;
+			}
+			default: // JR cc
+			{
+				signed char d = (signed char)fetch(cpu);
+				if (condition(cpu, y - 4))
+				{
+					cpu->pc += d;
+					return 12 + extra;
+				}
+				return 7 + extra;
+			}
+			}
+		case 1:
+			if (q == 0)
+			{
+				set_rp(cpu, p, fetch_word(cpu), index);
+				return 10 + extra;
+			}
+			set_rp(cpu, 2, add16(cpu, get_rp(cpu, 2, index), get_rp(cpu, p, index)), index);
+			return 11 + extra;
+		case 2:
+			switch (y)
+			{
+			case 0: WR(z80_bc(cpu), cpu->a); return 7 + extra;
+			case 1: cpu->a = RD(z80_bc(cpu)); return 7 + extra;
+			case 2: WR(z80_de(cpu), cpu->a); return 7 + extra;
+			case 3: cpu->a = RD(z80_de(cpu)); return 7 + extra;
+			case 4: write_word(cpu, fetch_word(cpu), get_rp(cpu, 2, index)); return 16 + extra;
+			case 5: set_rp(cpu, 2, read_word(cpu, fetch_word(cpu)), index); return 16 + extra;
+			case 6: WR(fetch_word(cpu), cpu->a); return 13 + extra;
+			default: cpu->a = RD(fetch_word(cpu)); return 13 + extra;
+			}
+		case 3:
+			set_rp(cpu, p, get_rp(cpu, p, index) + (q ? -1 : 1), index);
+			return 6 + extra;
+		case 4:
+		case 5:
+			if (y == 6)
+			{
+				word addr = MEM_ADDR();
+				WR(addr, z == 4 ? inc8(cpu, RD(addr)) : dec8(cpu, RD(addr)));
+				return 11 + extra + (index ? 8 : 0);
+			}
+			set_r(cpu, y, z == 4 ? inc8(cpu, get_r(cpu, y, index)) : dec8(cpu, get_r(cpu, y, index)), index);
+			return 4 + extra;
+		case 6:
+			if (y == 6)
+			{
+				word addr = MEM_ADDR();
+				WR(addr, fetch(cpu));
+				return 10 + extra + (index ? 5 : 0);
+			}
+			set_r(cpu, y, fetch(cpu), index);
+			return 7 + extra;
+		default:
+		{
+			byte a = cpu->a;
+			switch (y)
+			{
+			case 0: cpu->a = (a << 1) | (a >> 7); cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | (cpu->a & (FLAG_X | FLAG_Y)) | (a >> 7); break;
+			case 1: cpu->a = (a >> 1) | (a << 7); cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | (cpu->a & (FLAG_X | FLAG_Y)) | (a & 1); break;
+			case 2: cpu->a = (a << 1) | (cpu->f & FLAG_C); cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | (cpu->a & (FLAG_X | FLAG_Y)) | (a >> 7); break;
+			case 3: cpu->a = (a >> 1) | ((cpu->f & FLAG_C) << 7); cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | (cpu->a & (FLAG_X | FLAG_Y)) | (a & 1); break;
+			case 4: daa(cpu); break;
+			case 5: cpu->a = ~a; cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV | FLAG_C)) | FLAG_H | FLAG_N | (cpu->a & (FLAG_X | FLAG_Y)); break;
+			case 6: cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | FLAG_C | (a & (FLAG_X | FLAG_Y)); break;
+			default: cpu->f = (cpu->f & (FLAG_S | FLAG_Z | FLAG_PV)) | ((cpu->f & FLAG_C) ? FLAG_H : FLAG_C) | (a & (FLAG_X | FLAG_Y)); break;
+			}
+			return 4 + extra;
+		}
+		}
+	case 1:
+		if (op == 0x76)
+		{
+			cpu->halted = 1;
+			cpu->pc--;
+			return 4 + extra;
+		}
+		if (y == 6)
+		{
+			// LD (HL),r uses the plain H/L registers even with a prefix
+			word addr = MEM_ADDR();
+			WR(addr, get_r(cpu, z, 0));
+			return 7 + extra + (index ? 8 : 0);
+		}
+		if (z == 6)
+		{
+			word addr = MEM_ADDR();
+			set_r(cpu, y, RD(addr), 0);
+			return 7 + extra + (index ? 8 : 0);
+		}
+		set_r(cpu, y, get_r(cpu, z, index), index);
+		return 4 + extra;
+	case 2:
+		if (z == 6)
+		{
+			word addr = MEM_ADDR();
+			alu(cpu, y, RD(addr));
+			return 7 + extra + (index ? 8 : 0);
+		}
+		alu(cpu, y, get_r(cpu, z, index));
+		return 4 + extra;
+	default:
+		switch (z)
+		{
+		case 0: // RET cc
+			if (condition(cpu, y))
+			{
+				cpu->pc = z80_pop(cpu);
+				return 11 + extra;
+			}
+			return 5 + extra;
+		case 1:
+			if (q == 0)
+			{
+				set_rp2(cpu, p, z80_pop(cpu), index);
+				return 10 + extra;
+			}
+			switch (p)
+			{
+			case 0: cpu->pc = z80_pop(cpu); return 10 + extra;	// RET
+			case 1: // EXX
+			{
+				byte t;
+				t = cpu->b; cpu->b = cpu->b_; cpu->b_ = t;
+				t = cpu->c; cpu->c = cpu->c_; cpu->c_ = t;
+				t = cpu->d; cpu->d = cpu->d_; cpu->d_ = t;
+				t = cpu->e; cpu->e = cpu->e_; cpu->e_ = t;
+				t = cpu->h; cpu->h = cpu->h_; cpu->h_ = t;
+				t = cpu->l; cpu->l = cpu->l_; cpu->l_ = t;
+				return 4 + extra;
+			}
+			case 2: cpu->pc = get_rp(cpu, 2, index); return 4 + extra;	// JP (HL)
+			default: cpu->sp = get_rp(cpu, 2, index); return 6 + extra;	// LD SP,HL
+			}
+		case 2: // JP cc,nn
+		{
+			word addr = fetch_word(cpu);
+			if (condition(cpu, y)) cpu->pc = addr;
+			return 10 + extra;
+		}
+		case 3:
+			switch (y)
+			{
+			case 0: cpu->pc = fetch_word(cpu); return 10 + extra;
+			case 1: return exec_cb(cpu, 0, 0);	// Not reached, CB is handled by the caller
+			case 2:
+			{
+				byte port = fetch(cpu);
+				if (cpu->out) cpu->out(cpu, (cpu->a << 8) | port, cpu->a);
+				return 11 + extra;
+			}
+			case 3:
+			{
+				byte port = fetch(cpu);
+				cpu->a = cpu->in ? cpu->in(cpu, (cpu->a << 8) | port) : 0xFF;
+				return 11 + extra;
+			}
+			case 4: // EX (SP),HL
+			{
+				word v = read_word(cpu, cpu->sp);
+				write_word(cpu, cpu->sp, get_rp(cpu, 2, index));
+				set_rp(cpu, 2, v, index);
+				return 19 + extra;
+			}
+			case 5: // EX DE,HL
+			{
+				byte t;
+				t = cpu->d; cpu->d = cpu->h; cpu->h = t;
+				t = cpu->e; cpu->e = cpu->l; cpu->l = t;
+				return 4 + extra;
+			}
+			case 6: cpu->iff1 = cpu->iff2 = 0; return 4 + extra;
+			default: cpu->iff1 = cpu->iff2 = 1; return 4 + extra;
+			}
+		case 4: // CALL cc,nn
+		{
+			word addr = fetch_word(cpu);
+			if (condition(cpu, y))
+			{
+				z80_push(cpu, cpu->pc);
+				cpu->pc = addr;
+				return 17 + extra;
+			}
+			return 10 + extra;
+		}
+		case 5:
+			if (q == 0)
+			{
+				z80_push(cpu, get_rp2(cpu, p, index));
+				return 11 + extra;
+			}
+			// CALL nn, the other encodings are prefixes
+			{
+				word addr = fetch_word(cpu);
+				z80_push(cpu, cpu->pc);
+				cpu->pc = addr;
+				return 17 + extra;
+			}
+		case 6:
+			alu(cpu, y, fetch(cpu));
+			return 7 + extra;
+		default: // RST
+			z80_push(cpu, cpu->pc);
+			cpu->pc = y << 3;
+			return 11 + extra;
+		}
+	}
+#undef MEM_ADDR
+}
+
+int z80_step(Z80* cpu)
+{
+	word* index = 0;
+	int prefix = 0;
+	byte op = fetch(cpu);
+	inc_r(cpu);
+	// Chains of DD/FD prefixes: the last one wins, each costs 4
+	while (op == 0xDD || op == 0xFD)
+	{
+		index = op == 0xDD ? &cpu->ix : &cpu->iy;
+		op = fetch(cpu);
+		inc_r(cpu);
+		prefix += 4;
+	}
+	int t;
+	if (op == 0xCB)
+	{
+		if (index)
+		{
+			word addr = *index + (signed char)fetch(cpu);
+			t = exec_cb(cpu, index, addr);
+			prefix -= 4;	// Included in the DD CB timings
+		}
+		else
+		{
+			t = exec_cb(cpu, 0, 0);
+		}
+	}
+	else if (op == 0xED)
+	{
+		t = exec_ed(cpu);
+	}
+	else
+	{
+		t = exec_main(cpu, op, index);
+		if (index) prefix -= 4;		// exec_main accounts for one prefix
+	}
+	t += prefix;
+	cpu->tstates += t;
+	cpu->instructions++;
+	return t;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+
+// Instruction level Z80 core.  T-states are counted per instruction,
+// including the extra cycles of taken conditional branches and
+// repeated block instructions.
+
+#define FLAG_C  0x01
+#define FLAG_N  0x02
+#define FLAG_PV 0x04
+#define FLAG_X  0x08
+#define FLAG_H  0x10
+#define FLAG_Y  0x20
+#define FLAG_Z  0x40
+#define FLAG_S  0x80
+
+typedef struct z80_ Z80;
+
+typedef byte (*z80_in_func)(Z80* cpu, word port);
+typedef void (*z80_out_func)(Z80* cpu, word port, byte value);
+
+struct z80_
+{
+	byte	a, f, b, c, d, e, h, l;
+	byte	a_, f_, b_, c_, d_, e_, h_, l_;	// Alternate set
+	word	ix, iy, sp, pc;
+	byte	i, r, iff1, iff2, im;
+	byte	halted;
+	unsigned long long	tstates;
+	unsigned long long	instructions;
+	byte*	memory;		// 64K
+	z80_in_func		in;
+	z80_out_func	out;
+};
+
+void z80_reset(Z80* cpu, byte* memory);
+
+// Execute one instruction.  Returns the number of T-states it took
+int  z80_step(Z80* cpu);
+
+word z80_bc(Z80* cpu);
+word z80_de(Z80* cpu);
+word z80_hl(Z80* cpu);
+void z80_set_hl(Z80* cpu, word value);
+void z80_push(Z80* cpu, word value);
+word z80_pop(Z80* cpu);
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Generates keywords.c: a perfect hash over the language keywords,
+# so the lexer classifies an identifier with one probe and one compare.
+from typing import List, Tuple
+
+import argh
+
+KEYWORDS = [
+    ('byte', 'BYTE'), ('word', 'WORD'), ('sbyte', 'SBYTE'), ('sword', 'SWORD'),
+    ('array', 'ARRAY'), ('addr', 'ADDR'), ('if', 'IF'), ('else', 'ELSE'),
+    ('while', 'WHILE'), ('struct', 'STRUCT'), ('var', 'VAR'), ('fun', 'FUN'),
+    ('wfun', 'WFUN'), ('end', 'END'), ('const', 'CONST'), ('extern', 'EXTERN'),
+    ('return', 'RETURN'), ('fast', 'FAST'),
+]
+
+
+def kw_hash(text: str, shifts: Tuple[int, int, int], mask: int) -> int:
+    # Second character is 0 for single letter identifiers, as in the lexer buffer
+    second = ord(text[1]) if len(text) > 1 else 0
+    return ((ord(text[0]) << shifts[0]) + (second << shifts[1]) + (len(text) << shifts[2])) & mask
+
+
+def find_hash(words: List[str]):
+    for size in (16, 32, 64, 128):
+        for a in range(8):
+            for b in range(8):
+                for c in range(8):
+                    shifts = (a, b, c)
+                    slots = {kw_hash(w, shifts, size - 1) for w in words}
+                    if len(slots) == len(words):
+                        return size, shifts
+    raise RuntimeError('No perfect hash found')
+
+
+def main(output: str = 'keywords.c'):
+    size, shifts = find_hash([k for k, _ in KEYWORDS])
+    slots = [0] * size
+    for i, (text, _) in enumerate(KEYWORDS):
+        slots[kw_hash(text, shifts, size - 1)] = i + 1
+    with open(output, 'w') as f:
+        f.write('// Generated by genkw.py.  Do not edit.\n')
+        f.write('#include "keywords.h"\n#include "consts.h"\n\n')
+        lengths = [len(k) for k, _ in KEYWORDS]
+        f.write(f'#define KW_SLOTS {size}\n')
+        f.write(f'#define KW_MIN_LENGTH {min(lengths)}\n')
+        f.write(f'#define KW_MAX_LENGTH {max(lengths)}\n')
+        f.write(f'#define KW_HASH(t,len) ((((word)(byte)(t)[0]<<{shifts[0]}) + ((word)(byte)(t)[1]<<{shifts[1]}) + '
+                f'((word)(len)<<{shifts[2]})) & (KW_SLOTS-1))\n\n')
+        f.write('typedef struct keyword_\n{\n\tconst char*\ttext;\n\tbyte\t\ttype;\n} Keyword;\n\n')
+        f.write('static const Keyword keywords[] = {\n')
+        for text, token in KEYWORDS:
+            f.write(f'\t{{ "{text}", {token} }},\n')
+        f.write('};\n\n')
+        f.write('// Index+1 into keywords, 0 for no keyword\n')
+        f.write('static const byte slots[KW_SLOTS] = {')
+        for i, s in enumerate(slots):
+            if i % 16 == 0:
+                f.write('\n\t')
+            f.write(f'{s},' if i + 1 < size else f'{s}')
+            if i % 16 != 15 and i + 1 < size:
+                f.write(' ')
+        f.write('\n};\n\n')
+        f.write('''byte kw_lookup(const char* text, byte length)
+{
+\tif (length < KW_MIN_LENGTH || length > KW_MAX_LENGTH) return IDENT;
+\tbyte slot = slots[KW_HASH(text, length)];
+\tif (!slot) return IDENT;
+\tconst Keyword* kw = &keywords[slot - 1];
+\tconst char* k = kw->text;
+\tfor (; *k; ++k, ++text)
+\t\tif (*k != *text) return IDENT;
+\treturn (*text == 0) ? kw->type : IDENT;
+}
+
+const char* kw_text(byte type)
+{
+\tfor (byte i = 0; i < (sizeof(keywords) / sizeof(Keyword)); ++i)
+\t\tif (keywords[i].type == type) return keywords[i].text;
+\treturn 0;
+}
+''')
+
+
+if __name__ == '__main__':
+    argh.dispatch_command(main)
@@ -7,6 +7,7 @@ from typing import Dict, NewType, List
 import argh
 import re
 import subprocess as sp
+from tracefile import read_records
 
 Address = NewType('Address', int)
 LineNumber = NewType('LineNumber', int)
@@ -18,9 +19,8 @@ def read_text_file(filename: str) -> List[str]:
 
 def read_offsets(filename: str) -> Dict[Address, LineNumber]:
     res = {}
-    for line in open(filename).readlines():
-        values = [int(x, 16) for x in line.strip().split()]
-        res[Address(values[1])] = LineNumber(values[0])
+    for line, address in read_records(filename):
+        res[Address(address)] = LineNumber(line)
     return res
 
 
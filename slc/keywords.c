@@ -0,0 +1,62 @@
+// Generated by genkw.py.  Do not edit.
+#include "keywords.h"
+#include "consts.h"
+
+#define KW_SLOTS 64
+#define KW_MIN_LENGTH 2
+#define KW_MAX_LENGTH 6
+#define KW_HASH(t,len) ((((word)(byte)(t)[0]<<0) + ((word)(byte)(t)[1]<<1) + ((word)(len)<<0)) & (KW_SLOTS-1))
+
+typedef struct keyword_
+{
+	const char*	text;
+	byte		type;
+} Keyword;
+
+static const Keyword keywords[] = {
+	{ "byte", BYTE },
+	{ "word", WORD },
+	{ "sbyte", SBYTE },
+	{ "sword", SWORD },
+	{ "array", ARRAY },
+	{ "addr", ADDR },
+	{ "if", IF },
+	{ "else", ELSE },
+	{ "while", WHILE },
+	{ "struct", STRUCT },
+	{ "var", VAR },
+	{ "fun", FUN },
+	{ "wfun", WFUN },
+	{ "end", END },
+	{ "const", CONST },
+	{ "extern", EXTERN },
+	{ "return", RETURN },
+	{ "fast", FAST },
+};
+
+// Index+1 into keywords, 0 for no keyword
+static const byte slots[KW_SLOTS] = {
+	0, 8, 17, 0, 14, 0, 15, 13, 0, 0, 5, 0, 9, 0, 0, 0,
+	0, 0, 0, 12, 0, 0, 0, 0, 1, 2, 0, 16, 0, 0, 0, 0,
+	0, 10, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 18, 6, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 7, 0, 0, 0, 11, 3, 0, 0, 0
+};
+
+byte kw_lookup(const char* text, byte length)
+{
+	if (length < KW_MIN_LENGTH || length > KW_MAX_LENGTH) return IDENT;
+	byte slot = slots[KW_HASH(text, length)];
+	if (!slot) return IDENT;
+	const Keyword* kw = &keywords[slot - 1];
+	const char* k = kw->text;
+	for (; *k; ++k, ++text)
+		if (*k != *text) return IDENT;
+	return (*text == 0) ? kw->type : IDENT;
+}
+
+const char* kw_text(byte type)
+{
+	for (byte i = 0; i < (sizeof(keywords) / sizeof(Keyword)); ++i)
+		if (keywords[i].type == type) return keywords[i].text;
+	return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "types.h"
+
+// Classify an identifier.  Returns the keyword token type, or IDENT
+byte kw_lookup(const char* text, byte length);
+
+// Text of a keyword token type, or 0 if the type is not a keyword
+const char* kw_text(byte type);
@@ -1,6 +1,8 @@
 #include "lexer.h"
 #include <strhash.h>
 #include "vector.h"
+#include "keywords.h"
+#include "stats.h"
 
 extern StrHash* texts;
 
@@ -11,7 +13,7 @@ extern StrHash* texts;
 
 #define BUF_SIZE 16
 
-extern byte next_byte();
+#define next_byte() (src_ptr < src_end ? *src_ptr++ : src_fill())
 static byte buffer[BUF_SIZE];
 static byte bpos = 0;
 static byte last_char = 0;
@@ -70,44 +72,12 @@ static void close_buffer()
 	bpos = 0;
 }
 
-int compare(const char* a, const char* b)
-{
-	while (1)
-	{
-		if (*a == 0 && *b == 0) return 0;
-		if (*a == 0) return 1;
-		if (*b == 0) return -1;
-		if (*a == *b)
-		{
-			++a;
-			++b;
-		}
-		else
-			return (*a < *b ? -1 : 1);
-	}
-}
-
 static byte close_alpha_token(Token* t)
 {
+	byte length = bpos;
 	close_buffer();
-	if (compare((const char*)buffer, "byte") == 0) { t->type = BYTE; return 1; }
-	if (compare((const char*)buffer, "word") == 0) { t->type = WORD; return 1; }
-	if (compare((const char*)buffer, "sbyte") == 0) { t->type = SBYTE; return 1; }
-	if (compare((const char*)buffer, "sword") == 0) { t->type = SWORD; return 1; }
-	if (compare((const char*)buffer, "array") == 0) { t->type = ARRAY; return 1; }
-	if (compare((const char*)buffer, "addr") == 0) { t->type = ADDR; return 1; }
-	if (compare((const char*)buffer, "if") == 0) { t->type = IF; return 1; }
-	if (compare((const char*)buffer, "else") == 0) { t->type = ELSE; return 1; }
-	if (compare((const char*)buffer, "while") == 0) { t->type = WHILE; return 1; }
-	if (compare((const char*)buffer, "struct") == 0) { t->type = STRUCT; return 1; }
-	if (compare((const char*)buffer, "var") == 0) { t->type = VAR; return 1; }
-	if (compare((const char*)buffer, "fun") == 0) { t->type = FUN; return 1; }
-	if (compare((const char*)buffer, "wfun") == 0) { t->type = WFUN; return 1; }
-	if (compare((const char*)buffer, "end") == 0) { t->type = END; return 1; }
-	if (compare((const char*)buffer, "const") == 0) { t->type = CONST; return 1; }
-	if (compare((const char*)buffer, "extern") == 0) { t->type = EXTERN; return 1; }
-	if (compare((const char*)buffer, "return") == 0) { t->type = RETURN; return 1; }
-	t->type = IDENT;
+	t->type = kw_lookup((const char*)buffer, length);
+	if (t->type != IDENT) return 1;
 	t->value = sh_get(texts, (const char*)buffer);
 	return 1;
 }
@@ -125,7 +95,7 @@ word lex_line()
 	return line;
 }
 
-#define ADD(x) { t.type=x; t.line=line; vector_push(tokens, &t); continue; }
+#define ADD(x) { t.type=x; t.line=line; vector_push(tokens, &t); STAT_INC(tokens); continue; }
 
 
 static void analyze()
@@ -211,6 +181,9 @@ static void analyze()
 			case '&': ADD(AMP);
 			case '|': ADD(PIPE);
 			case '^': ADD(CARET);
+			case '*': ADD(STAR);
+			case '/': ADD(SLASH);
+			case '%': ADD(PERCENT);
 			case '\n': next_line=1; ADD(EOL);
 			case '<':
 			case '>':
@@ -284,7 +257,12 @@ byte lex_get(word index, Token* t)
 	if (index < token_offset) return 0; // Cannot look back more than 4 tokens
 	index-=token_offset;
 	if (index>=10) return 0; // Cannot look ahead too far
-	if (index>=vector_size(tokens)) analyze();
+	if (index>=vector_size(tokens))
+	{
+		STATS_ENTER(PHASE_LEX);
+		analyze();
+		STATS_LEAVE();
+	}
 	if (!vector_get(tokens, index, t)) return 0;
 	if (index >= 8)
 	{
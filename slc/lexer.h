@@ -10,6 +10,13 @@ typedef struct token
 	word line;
 } Token;
 
+// Source text is consumed from a block buffer filled by the reader in main.c
+#define SOURCE_BLOCK 256
+extern const byte* src_ptr;
+extern const byte* src_end;
+// Refill the buffer and return its first byte, 0 at end of file
+byte src_fill();
+
 void lex_init();
 //word lex_size();
 byte lex_get(word index, Token* t);
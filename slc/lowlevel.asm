@@ -5,6 +5,7 @@
 	.globl _multiply
 	.globl ___sdcc_call_iy
 	.globl ___sdcc_enter_ix
+	.globl _os_service
 
 ___sdcc_call_hl:
 	jp	(hl)
@@ -20,4 +21,18 @@ ___sdcc_enter_ix:
    push ix
    ld ix,#0
    add ix,sp
-   jp (hl)
\ No newline at end of file
+   jp (hl)
+
+; word os_service(byte service, word hl, word de)
+; Arguments on the stack (sdcccall 0).  A=service, HL and DE as given,
+; the service result is returned in HL
+_os_service:
+   ld iy,#2
+   add iy,sp
+   ld a,0(iy)
+   ld l,1(iy)
+   ld h,2(iy)
+   ld e,3(iy)
+   ld d,4(iy)
+   rst 8
+   ret
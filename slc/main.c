@@ -1,6 +1,7 @@
 #ifdef DEV
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #endif
 #include "strhash.h"
 #include "memory.h"
@@ -9,80 +10,162 @@
 #include "codegen.h"
 #include "dev.h"
 #include "optimizer.h"
+#include "stats.h"
+#include "trace.h"
 
 StrHash* texts;
 char program_filename[32];
 
+const byte* src_ptr = 0;
+const byte* src_end = 0;
+static byte src_eof = 0;
+
 #ifdef CODE_FILE
 
+// The generated program is assembled in memory and written once on close
+static byte*  output_image = 0;
+static size_t output_size = 0;
+static size_t output_capacity = 0;
+
+#ifdef _WIN32
+
 static FILE* code_stream = 0;
-static FILE* output_file = 0;
-static byte  code_eof = 0;
+static byte  src_block[SOURCE_BLOCK];
 
-byte next_byte()
+static byte read_block()
 {
-	if (code_eof) return 0;
 	if (!code_stream)
 	{
-		code_stream = fopen(program_filename, "r");
+		code_stream = fopen(program_filename, "rb");
 		if (!code_stream)
 		{
 			fprintf(stderr, "Failed to open code file.\n");
 			exit(1);
 		}
 	}
-	int res = fgetc(code_stream);
-	if (res == EOF)
+	size_t n = fread(src_block, 1, SOURCE_BLOCK, code_stream);
+	if (n == 0)
 	{
 		fclose(code_stream);
 		code_stream = 0;
-		code_eof = 1;
 		return 0;
 	}
-	return (byte)(res & 255);
+	src_ptr = src_block;
+	src_end = src_block + n;
+	return 1;
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void*  src_map = 0;
+static size_t src_map_size = 0;
+
+// The whole file is mapped on the first call, the second call reports EOF
+static byte read_block()
+{
+	if (src_map)
+	{
+		munmap(src_map, src_map_size);
+		src_map = 0;
+		return 0;
+	}
+	int fd = open(program_filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Failed to open code file.\n");
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	src_map_size = (size_t)st.st_size;
+	src_map = mmap(0, src_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (src_map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map code file.\n");
+		exit(1);
+	}
+	src_ptr = (const byte*)src_map;
+	src_end = src_ptr + src_map_size;
+	return 1;
 }
 
+#endif
+
 byte write_output(word offset, const byte* data, word length)
 {
-	if (!output_file) output_file = fopen("out.bin", "wb");
-	fseek(output_file, offset, SEEK_SET);
-	return fwrite(data, 1, length, output_file);
+	STAT_INC(output_writes);
+	STAT_ADD(output_bytes, length);
+	if (offset != output_size) STAT_INC(output_seeks);
+	size_t end = (size_t)offset + length;
+	if (end > output_capacity)
+	{
+		size_t capacity = output_capacity ? output_capacity * 2 : 0x1000;
+		while (capacity < end) capacity *= 2;
+		byte* image = (byte*)realloc(output_image, capacity);
+		if (!image) return 0;
+		output_image = image;
+		output_capacity = capacity;
+	}
+	if (offset > output_size)
+		memset(output_image + output_size, 0, offset - output_size);
+	memcpy(output_image + offset, data, length);
+	if (end > output_size) output_size = end;
+	return 1;
 }
 
 void close_output()
 {
-	if (output_file)
+	if (output_image)
 	{
-		fclose(output_file);
-		output_file = 0;
+		FILE* output_file = fopen("out.bin", "wb");
+		if (output_file)
+		{
+			fwrite(output_image, 1, output_size, output_file);
+			fclose(output_file);
+		}
+		free(output_image);
+		output_image = 0;
+		output_size = output_capacity = 0;
 	}
 }
 
 #else
 
+#include "services.h"
+
+// OS service call (RST 08h), implemented in lowlevel.asm
+word __sdcccall(0) os_service(byte service, word hl, word de);
 
-/**  Sample code **/
-const char* code=
-"var byte a\n"
-"struct Cell\n"
-"  var byte width\n"
-"  var byte height\n"
-"end\n"
-"var array 8 byte b\n"
-"fun main()\n"
-"  a=0\n"
-"  while a<8\n"
-"    a=a+1\n"
-"  end\n"
-"end\n";
-
-const char* ptr=0;
-
-byte next_byte()
+static byte src_block[SOURCE_BLOCK];
+static byte src_open = 0;
+
+static byte read_block()
 {
-	if (!ptr) ptr = code;
-	if (!(*ptr)) return 0;
-	return *ptr++;
+	if (!src_open)
+	{
+		if (!os_service(SERVICE_OPEN_FILE, (word)program_filename, 0)) return 0;
+		src_open = 1;
+	}
+	word n = os_service(SERVICE_READ_FILE, (word)src_block, SOURCE_BLOCK);
+	if (n == 0)
+	{
+		os_service(SERVICE_CLOSE_FILE, 0, 0);
+		src_open = 0;
+		return 0;
+	}
+	src_ptr = src_block;
+	src_end = src_block + n;
+	return 1;
 }
 
 byte write_output(word offset, const byte* data, word length) 
@@ -97,8 +180,43 @@ void close_output() {}
 
 #endif
 
+// Called by the lexer when the current block is exhausted
+byte src_fill()
+{
+	if (src_eof) return 0;
+	if (!read_block())
+	{
+		src_eof = 1;
+		src_ptr = src_end = 0;
+		return 0;
+	}
+	return *src_ptr++;
+}
+
 int main(int argc, char* argv[])
 {
+#ifdef DEV
+	// --stats writes instrumentation counters to stats.json,
+	// --no-trace skips writing alloc.log and line_offsets.log
+	byte write_stats = 0;
+	while (argc > 2 && strncmp(argv[1], "--", 2) == 0)
+	{
+		if (strcmp(argv[1], "--stats") == 0)
+		{
+			write_stats = 1;
+			stats_start();
+		}
+		else if (strcmp(argv[1], "--no-trace") == 0)
+			trace_enable(0);
+		else
+		{
+			printf("Unknown option: %s\n", argv[1]);
+			return 1;
+		}
+		--argc;
+		++argv;
+	}
+#endif
 	if (argc > 1)
 	{
 		char* dst=program_filename;
@@ -114,7 +232,7 @@ int main(int argc, char* argv[])
 	else
 	{
 #ifdef DEV
-		printf("Usage: slc <source>\n");
+		printf("Usage: slc [--stats] [--no-trace] <source>\n");
 #endif
 		return 1;
 	}
@@ -128,16 +246,22 @@ int main(int argc, char* argv[])
 	//dev_print_tree(p_root());
 	generate_code(p_parse, write_output);
 	close_output();
-/*
-	opt_init(gen_get_functions(), gen_get_unknowns());
+#ifdef CODE_FILE
+	STATS_ENTER(PHASE_OPTIMIZE);
+	opt_init(gen_get_functions(), gen_get_relocations());
 	opt_exec("out.bin");
 	opt_shut();
-*/
+	STATS_LEAVE();
+#endif
 	gen_shut();
 	p_shut();
 	lex_shut();
 	sh_shut(texts);
 	dev_shut();
+#ifdef DEV
+	if (write_stats && !stats_write("stats.json"))
+		printf("Failed to write stats.json\n");
+#endif
 	alloc_shut();
 #ifdef DEV
 	printf("Total memory leaked: %d\n", get_total_allocated());
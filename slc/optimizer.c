@@ -1,35 +1,962 @@
 #ifdef DEV
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #endif
 #include "optimizer.h"
 #include <vector.h>
+#include <trace.h>
+
+// Peephole optimizer over the emitted Z80 byte stream.
+// Function bodies are decoded into instructions and scanned with a
+// window of WINDOW instructions against the pattern table.  Rewrites
+// shrink the code, so the image is laid out again afterwards: relative
+// jumps are recomputed and every absolute address operand (the
+// relocations, which include all unknowns fixups) is moved and
+// retargeted through an old to new offset map.
+// Absolute jumps within a function are then relaxed to JR where the
+// displacement fits, repeating until no more jumps shrink.
+
+#define OS_SIZE 0x1000
+#define WINDOW 8
+#define NO_POS 0xFFFF
+#define MAX_MATCH 4
+#define MAX_REPLACE 2
+
+// Registers tracked for liveness
+#define R_B  0x001
+#define R_C  0x002
+#define R_D  0x004
+#define R_E  0x008
+#define R_H  0x010
+#define R_L  0x020
+#define R_A  0x040
+#define R_F  0x080
+#define R_IX 0x100
+#define R_ALL 0x1FF
+#define R_BC (R_B | R_C)
+#define R_DE (R_D | R_E)
+#define R_HL (R_H | R_L)
+
+typedef struct instr_
+{
+	word	pos;		// Offset in the input image, NO_POS for inserted code
+	word	new_pos;	// Offset in the output image
+	byte	length;
+	byte	bytes[4];
+	byte	reloc;		// Offset of an absolute address operand in bytes, 0 if none
+	byte	label;		// Jump target.  Only the first instruction of a match may be one
+	word	target;		// Input offset a relative jump goes to, NO_POS if not a jump
+} Instr;
+
+typedef enum condition_
+{
+	ALWAYS,
+	HL_DEAD,		// HL is overwritten before it is read again
+	BC_HOLDS_IX		// BC was loaded from IX and not changed since
+} Condition;
+
+typedef struct pattern_
+{
+	word		match[MAX_MATCH];		// Opcodes as (prefix << 8) | opcode, operands are not compared
+	byte		match_count;
+	word		replace[MAX_REPLACE];	// Operands are copied from the matched instruction that has one
+	byte		replace_count;
+	Condition	condition;
+	byte		tstates;				// Saved per execution
+} Pattern;
+
+static const Pattern patterns[] = {
+	//  ld hl,nn  push hl  pop bc     ->  ld bc,nn
+	{ { 0x21, 0xE5, 0xC1 }, 3, { 0x01 }, 1, HL_DEAD, 21 },
+	//  ld hl,nn  push hl  pop de     ->  ld de,nn
+	{ { 0x21, 0xE5, 0xD1 }, 3, { 0x11 }, 1, HL_DEAD, 21 },
+	//  ld hl,nn  ld b,h  ld c,l      ->  ld bc,nn
+	{ { 0x21, 0x44, 0x4D }, 3, { 0x01 }, 1, HL_DEAD, 8 },
+	//  ld hl,nn  ld d,h  ld e,l      ->  ld de,nn
+	{ { 0x21, 0x54, 0x5D }, 3, { 0x11 }, 1, HL_DEAD, 8 },
+	//  push ix  pop bc               ->  (BC already holds IX)
+	{ { 0xDDE5, 0xC1 }, 2, { 0 }, 0, BC_HOLDS_IX, 25 },
+	//  push rr  pop rr               ->  (nothing)
+	{ { 0xE5, 0xE1 }, 2, { 0 }, 0, ALWAYS, 21 },
+	{ { 0xC5, 0xC1 }, 2, { 0 }, 0, ALWAYS, 21 },
+	{ { 0xD5, 0xD1 }, 2, { 0 }, 0, ALWAYS, 21 },
+	{ { 0xF5, 0xF1 }, 2, { 0 }, 0, ALWAYS, 21 },
+	{ { 0xDDE5, 0xDDE1 }, 2, { 0 }, 0, ALWAYS, 29 },
+	//  push rr  pop ss               ->  ld s,r  ld s',r'
+	{ { 0xE5, 0xC1 }, 2, { 0x44, 0x4D }, 2, ALWAYS, 13 },		// ld b,h  ld c,l
+	{ { 0xE5, 0xD1 }, 2, { 0x54, 0x5D }, 2, ALWAYS, 13 },		// ld d,h  ld e,l
+	{ { 0xC5, 0xE1 }, 2, { 0x60, 0x69 }, 2, ALWAYS, 13 },		// ld h,b  ld l,c
+	{ { 0xD5, 0xE1 }, 2, { 0x62, 0x6B }, 2, ALWAYS, 13 },		// ld h,d  ld l,e
+	{ { 0xC5, 0xD1 }, 2, { 0x50, 0x59 }, 2, ALWAYS, 13 },		// ld d,b  ld e,c
+	{ { 0xD5, 0xC1 }, 2, { 0x42, 0x4B }, 2, ALWAYS, 13 },		// ld b,d  ld c,e
+	//  Copying a pair back to where it came from
+	{ { 0x60, 0x69, 0x44, 0x4D }, 4, { 0x60, 0x69 }, 2, ALWAYS, 8 },
+	{ { 0x44, 0x4D, 0x60, 0x69 }, 4, { 0x44, 0x4D }, 2, ALWAYS, 8 },
+	{ { 0x62, 0x6B, 0x54, 0x5D }, 4, { 0x62, 0x6B }, 2, ALWAYS, 8 },
+	{ { 0x54, 0x5D, 0x62, 0x6B }, 4, { 0x54, 0x5D }, 2, ALWAYS, 8 },
+};
+
+#define PATTERN_COUNT (sizeof(patterns) / sizeof(Pattern))
 
 Vector* line_starts=0;
+static Vector* functions=0;
+static Relocations* relocations=0;
+static word bytes_saved=0;
+static unsigned long tstates_saved=0;
+static word rewrites=0;
+static word relaxed=0;
+static word removed=0;
+
+/////////////////////////////////////////////////////////////////////
+// Decoding
+/////////////////////////////////////////////////////////////////////
+
+static const word reg_bits[8] = { R_B, R_C, R_D, R_E, R_H, R_L, 0, R_A };
+static const word rp_bits[4] = { R_BC, R_DE, R_HL, 0 };
+
+static byte is_index_prefix(byte b)
+{
+	return b == 0xDD || b == 0xFD;
+}
+
+// Unprefixed opcodes that take an (HL) operand, which becomes (IX+d)
+static byte uses_mem_hl(byte op)
+{
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	if (x == 0) return (z == 4 || z == 5 || z == 6) && y == 6;
+	if (x == 1) return op != 0x76 && (y == 6 || z == 6);
+	if (x == 2) return z == 6;
+	return 0;
+}
+
+static byte base_length(byte op)
+{
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	byte q = y & 1;
+	if (x == 0)
+	{
+		switch (z)
+		{
+		case 0: return y >= 2 ? 2 : 1;
+		case 1: return q ? 1 : 3;
+		case 2: return y >= 4 ? 3 : 1;
+		case 6: return 2;
+		default: return 1;
+		}
+	}
+	if (x == 3)
+	{
+		switch (z)
+		{
+		case 2: return 3;
+		case 3: return y == 0 ? 3 : ((y == 2 || y == 3) ? 2 : 1);
+		case 4: return 3;
+		case 5: return q ? 3 : 1;	// CALL nn (the prefixes are handled by the caller)
+		case 6: return 2;
+		default: return 1;
+		}
+	}
+	return 1;
+}
+
+static byte instr_length(const byte* code, word avail)
+{
+	byte len;
+	byte op = code[0];
+	if (op == 0xCB) len = 2;
+	else
+	if (op == 0xED)
+		len = (avail > 1 && (code[1] & 0xC7) == 0x43) ? 4 : 2;
+	else
+	if (is_index_prefix(op))
+	{
+		if (avail < 2) len = 1;
+		else
+		if (code[1] == 0xCB) len = 4;
+		else
+		if (is_index_prefix(code[1]) || code[1] == 0xED) len = 1;
+		else len = 1 + base_length(code[1]) + (uses_mem_hl(code[1]) ? 1 : 0);
+	}
+	else len = base_length(op);
+	return len > avail ? (byte)avail : len;
+}
+
+static word opcode(const Instr* in)
+{
+	byte b = in->bytes[0];
+	if ((b == 0xCB || b == 0xED || is_index_prefix(b)) && in->length > 1)
+		return (b << 8) | in->bytes[1];
+	return b;
+}
+
+static byte is_relative_jump(const Instr* in)
+{
+	byte b = in->bytes[0];
+	return b == 0x10 || b == 0x18 || b == 0x20 || b == 0x28 || b == 0x30 || b == 0x38;
+}
+
+// Registers read and written by an instruction.  flow is set for
+// anything that may leave the fall through path.  Unknown encodings
+// read and write everything.
+static void effects(const Instr* in, word* reads, word* writes, byte* flow)
+{
+	byte op = in->bytes[0];
+	byte index = 0;
+	*reads = 0;
+	*writes = 0;
+	*flow = 0;
+	if (op == 0xCB)
+	{
+		byte cb = in->bytes[1];
+		byte x = cb >> 6, z = cb & 7;
+		word r = reg_bits[z] | (z == 6 ? R_HL : 0);
+		*reads = r | (x == 0 ? R_F : 0);
+		if (x == 1) *writes = R_F;
+		else *writes = reg_bits[z] | (x == 0 ? R_F : 0);
+		return;
+	}
+	if (op == 0xED)
+	{
+		byte ed = in->bytes[1];
+		byte x = ed >> 6, y = (ed >> 3) & 7, z = ed & 7;
+		byte p = y >> 1;
+		if (x == 1 && z == 2)
+		{
+			*reads = R_HL | R_F | rp_bits[p];
+			*writes = R_HL | R_F;
+			return;
+		}
+		if (x == 1 && z == 3)
+		{
+			if (y & 1) *writes = rp_bits[p];
+			else *reads = rp_bits[p];
+			return;
+		}
+		if (ed == 0x44)
+		{
+			*reads = R_A;
+			*writes = R_A | R_F;
+			return;
+		}
+		*reads = R_ALL;
+		*writes = R_ALL;
+		*flow = (x == 1 && z == 5);	// RETN / RETI
+		return;
+	}
+	if (is_index_prefix(op))
+	{
+		index = 1;
+		op = in->bytes[1];
+		if (op == 0xCB)
+		{
+			// (IX+d) bit operations
+			*reads = R_IX | R_F;
+			*writes = R_F;
+			return;
+		}
+	}
+	byte x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+	byte p = y >> 1, q = y & 1;
+	byte mem = uses_mem_hl(op);
+	// With an index prefix, HL means IX and H/L are the IX halves,
+	// except next to an (IX+d) operand where they are the real registers
+	word hl = index ? R_IX : R_HL;
+	word rb[8];
+	for (byte i = 0; i < 8; ++i) rb[i] = reg_bits[i];
+	if (index && !mem) rb[4] = rb[5] = R_IX;
+	word mem_reads = index ? R_IX : R_HL;
+	word rp[4] = { R_BC, R_DE, hl, 0 };
+	switch (x)
+	{
+	case 0:
+		switch (z)
+		{
+		case 0:
+			if (y == 1) { *reads = R_A | R_F; *writes = R_A | R_F; }
+			else
+			if (y == 2) { *reads = R_B; *writes = R_B; *flow = 1; }
+			else
+			if (y >= 3) { *reads = R_F; *flow = 1; }
+			return;
+		case 1:
+			if (q == 0) *writes = rp[p];
+			else { *reads = hl | rp[p]; *writes = hl | R_F; }
+			return;
+		case 2:
+			switch (y)
+			{
+			case 0: *reads = R_BC | R_A; return;
+			case 1: *reads = R_BC; *writes = R_A; return;
+			case 2: *reads = R_DE | R_A; return;
+			case 3: *reads = R_DE; *writes = R_A; return;
+			case 4: *reads = hl; return;
+			case 5: *writes = hl; return;
+			case 6: *reads = R_A; return;
+			default: *writes = R_A; return;
+			}
+		case 3:
+			*reads = rp[p];
+			*writes = rp[p];
+			return;
+		case 4:
+		case 5:
+			if (y == 6) { *reads = mem_reads | R_F; *writes = R_F; }
+			else { *reads = rb[y] | R_F; *writes = rb[y] | R_F; }
+			return;
+		case 6:
+			if (y == 6) *reads = mem_reads;
+			else *writes = rb[y];
+			return;
+		default:
+			*reads = R_A | R_F;
+			*writes = R_A | R_F;
+			return;
+		}
+	case 1:
+		if (op == 0x76) { *flow = 1; return; }
+		if (y == 6) { *reads = mem_reads | reg_bits[z]; return; }
+		if (z == 6) { *reads = mem_reads; *writes = reg_bits[y]; return; }
+		*reads = rb[z];
+		*writes = rb[y];
+		return;
+	case 2:
+		*reads = R_A | (z == 6 ? mem_reads : rb[z]) | ((y == 1 || y == 3) ? R_F : 0);
+		*writes = (y == 7) ? R_F : (R_A | R_F);
+		return;
+	default:
+		switch (z)
+		{
+		case 0: *reads = R_F; *flow = 1; return;
+		case 1:
+			if (q == 0)
+			{
+				*writes = p == 3 ? (R_A | R_F) : rp[p];
+				return;
+			}
+			switch (p)
+			{
+			case 0: *flow = 1; return;
+			case 1: *reads = R_BC | R_DE | R_HL; *writes = R_BC | R_DE | R_HL; return;
+			case 2: *reads = hl; *flow = 1; return;
+			default: *reads = hl; return;
+			}
+		case 2: *reads = R_F; *flow = 1; return;
+		case 3:
+			switch (y)
+			{
+			case 0: *flow = 1; return;
+			case 2: *reads = R_A; return;
+			case 3: *reads = R_A; *writes = R_A; return;
+			case 4: *reads = hl; *writes = hl; return;
+			case 5: *reads = R_DE | R_HL; *writes = R_DE | R_HL; return;
+			case 6:
+			case 7: return;
+			default: *reads = R_ALL; *writes = R_ALL; return;
+			}
+		case 4: *reads = R_ALL; *writes = R_ALL; *flow = 1; return;
+		case 5:
+			if (q == 0)
+			{
+				*reads = p == 3 ? (R_A | R_F) : rp[p];
+				return;
+			}
+			*reads = R_ALL; *writes = R_ALL; *flow = 1;
+			return;
+		case 6:
+			*reads = R_A | ((y == 1 || y == 3) ? R_F : 0);
+			*writes = (y == 7) ? R_F : (R_A | R_F);
+			return;
+		default:
+			*reads = R_ALL; *writes = R_ALL; *flow = 1;
+			return;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// Matching
+/////////////////////////////////////////////////////////////////////
+
+// Follow the fall through path from 'from' and check whether HL is
+// fully overwritten before any part of it is read
+static byte hl_dead(Instr* code, word from, word count)
+{
+	word killed = 0;
+	for (word i = from; i < count && i < (from + WINDOW); ++i)
+	{
+		word reads, writes;
+		byte flow;
+		effects(&code[i], &reads, &writes, &flow);
+		if (reads & R_HL & ~killed) return 0;
+		if (flow) return 0;
+		killed |= writes & R_HL;
+		if (killed == R_HL) return 1;
+	}
+	return 0;
+}
+
+static byte match(const Pattern* pat, Instr* code, word i, word count, byte bc_holds_ix)
+{
+	if ((i + pat->match_count) > count) return 0;
+	for (byte j = 0; j < pat->match_count; ++j)
+	{
+		if (opcode(&code[i + j]) != pat->match[j]) return 0;
+		if (j > 0 && code[i + j].label) return 0;
+	}
+	switch (pat->condition)
+	{
+	case HL_DEAD: return hl_dead(code, i + pat->match_count, count);
+	case BC_HOLDS_IX: return bc_holds_ix;
+	default: return 1;
+	}
+}
+
+static void build_instr(Instr* in, word op, const Instr* operand_source)
+{
+	in->pos = NO_POS;
+	in->reloc = 0;
+	in->label = 0;
+	in->target = NO_POS;
+	byte n = 0;
+	if (op > 0xFF) in->bytes[n++] = op >> 8;
+	in->bytes[n++] = op & 0xFF;
+	byte len = op > 0xFF ? 2 : base_length((byte)op);
+	if (len > n && operand_source)
+	{
+		// Operand comes from the end of the matched instruction
+		byte src = operand_source->length - (len - n);
+		for (byte k = n; k < len; ++k, ++src)
+			in->bytes[k] = operand_source->bytes[src];
+		if (operand_source->reloc) in->reloc = operand_source->reloc - (operand_source->length - len);
+	}
+	in->length = len;
+}
+
+// Update the 'BC holds IX' state after an instruction that is kept
+static byte track_bc(Instr* code, word i, byte state)
+{
+	word reads, writes;
+	byte flow;
+	effects(&code[i], &reads, &writes, &flow);
+	if (opcode(&code[i]) == 0xC1 && i > 0 && opcode(&code[i - 1]) == 0xDDE5 && !code[i].label)
+		return 1;
+	if (flow || (writes & (R_BC | R_IX))) return 0;
+	return state;
+}
+
+// One pass over a function.  Returns the new instruction count
+static word optimize_pass(Instr* code, word count, byte* changed)
+{
+	word out = 0;
+	byte bc_holds_ix = 0;
+	word i = 0;
+	while (i < count)
+	{
+		if (code[i].label) bc_holds_ix = 0;
+		const Pattern* applied = 0;
+		for (word k = 0; k < PATTERN_COUNT; ++k)
+		{
+			if (match(&patterns[k], code, i, count, bc_holds_ix))
+			{
+				applied = &patterns[k];
+				break;
+			}
+		}
+		if (!applied)
+		{
+			code[out] = code[i];
+			bc_holds_ix = track_bc(code, out, bc_holds_ix);
+			++out; ++i;
+			continue;
+		}
+		// Source of an operand for the replacement
+		const Instr* operand = 0;
+		for (byte j = 0; j < applied->match_count && !operand; ++j)
+		{
+			if (code[i + j].length > 1 && !is_index_prefix(code[i + j].bytes[0]))
+				operand = &code[i + j];
+		}
+		Instr first = code[i];
+		Instr repl[MAX_REPLACE];
+		for (byte j = 0; j < applied->replace_count; ++j)
+			build_instr(&repl[j], applied->replace[j], operand);
+		i += applied->match_count;
+		if (applied->replace_count > 0)
+		{
+			repl[0].pos = first.pos;
+			repl[0].label = first.label;
+			for (byte j = 0; j < applied->replace_count; ++j)
+			{
+				code[out] = repl[j];
+				bc_holds_ix = track_bc(code, out, bc_holds_ix);
+				++out;
+			}
+		}
+		else
+		if (first.label && i < count)
+			code[i].label = 1;	// The label moves to the next instruction
+		tstates_saved += applied->tstates;
+		++rewrites;
+		*changed = 1;
+	}
+	return out;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Layout
+/////////////////////////////////////////////////////////////////////
+
+typedef struct range_
+{
+	word	first;		// Index of the first instruction in the code array
+	word	count;
+} Range;
+
+// JR opcode for an absolute jump that has a relative form, 0 if none
+static byte relative_form(const Instr* in)
+{
+	if (in->length != 3 || in->reloc != 1) return 0;
+	switch (in->bytes[0])
+	{
+	case 0xC3: return 0x18;
+	case 0xC2: return 0x20;	// NZ
+	case 0xCA: return 0x28;	// Z
+	case 0xD2: return 0x30;	// NC
+	case 0xDA: return 0x38;	// C
+	}
+	return 0;
+}
+
+// Replace JP with JR where the target is in the same function and in
+// range.  Shortening a jump only brings other targets closer, so the
+// passes repeat until nothing changes.
+static void relax_jumps(Instr* code, word n, word start, word stop, word* first_target, word* offsets)
+{
+	for (word i = 0; i < n; ++i)
+	{
+		first_target[i] = NO_POS;
+		if (!relative_form(&code[i])) continue;
+		word target = (code[i].bytes[1] | (code[i].bytes[2] << 8)) - OS_SIZE;
+		if (target < start || target > stop) continue;
+		// Index of the instruction now at the target
+		word t = 0;
+		while (t < n && (code[t].pos == NO_POS || code[t].pos < target)) ++t;
+		first_target[i] = t;
+		code[i].target = target;
+	}
+	byte changed = 1;
+	while (changed)
+	{
+		changed = 0;
+		word offset = 0;
+		for (word i = 0; i < n; ++i)
+		{
+			offsets[i] = offset;
+			offset += code[i].length;
+		}
+		offsets[n] = offset;
+		for (word i = 0; i < n; ++i)
+		{
+			if (first_target[i] == NO_POS || code[i].length != 3) continue;
+			int disp = (int)offsets[first_target[i]] - (int)(offsets[i] + 2);
+			if (disp < -128 || disp > 127) continue;
+			code[i].bytes[0] = relative_form(&code[i]);
+			code[i].length = 2;
+			code[i].reloc = 0;
+			++relaxed;
+			changed = 1;
+		}
+	}
+	// Jumps that stay absolute
+	for (word i = 0; i < n; ++i)
+		if (code[i].length == 3 && first_target[i] != NO_POS) code[i].target = NO_POS;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Reachability
+/////////////////////////////////////////////////////////////////////
+
+// Index of the function holding an image offset, nf if none
+static word function_at(word pos, word nf)
+{
+	for (word f = 0; f < nf; ++f)
+	{
+		FunctionAddress* fa = (FunctionAddress*)vector_access(functions, f);
+		if (pos >= fa->start && pos < fa->stop) return f;
+	}
+	return nf;
+}
+
+static byte ends_flow(const Instr* in)
+{
+	byte b = in->bytes[0];
+	return b == 0xC3 || b == 0xC9 || b == 0x18 || b == 0xE9;
+}
+
+// Offset of the address operand of CALL / JP (1), 0 if the instruction is neither
+static byte jump_operand(const Instr* in)
+{
+	byte b = in->bytes[0];
+	return (b == 0xCD || b == 0xC3 || (b & 0xC7) == 0xC4 || (b & 0xC7) == 0xC2) ? 1 : 0;
+}
+
+// Offset of the immediate operand of LD rr,nn (including IX / IY), 0 if none
+static byte load_operand(const Instr* in)
+{
+	byte b = in->bytes[0];
+	if ((b & 0xCF) == 0x01) return 1;
+	if ((b == 0xDD || b == 0xFD) && in->bytes[1] == 0x21) return 2;
+	return 0;
+}
+
+// Functions are reached from absolute operands outside of any function
+// (the entry jump to main), then from calls, jumps and address loads in
+// reached functions, and by falling off the end of one into the next.
+// Operands without a relocation are followed too, in case the list lost
+// one.  Returns 0 if a call or jump into a function has no relocation,
+// since the code could then not be moved safely.
+static byte find_reachable(const byte* image, word size, const byte* is_reloc,
+	const Instr* code, const Range* ranges, word nf, byte* reached)
+{
+	for (word f = 0; f < nf; ++f) reached[f] = 0;
+	for (word i = 0; i + 1 < size; ++i)
+	{
+		if (is_reloc[i] != 1) continue;
+		word target = (image[i] | (image[i + 1] << 8)) - OS_SIZE;
+		word f = function_at(target, nf);
+		if (f < nf) reached[f] = 1;
+	}
+	byte changed = 1;
+	while (changed)
+	{
+		changed = 0;
+		for (word f = 0; f < nf; ++f)
+		{
+			if (reached[f] != 1) continue;
+			reached[f] = 2;	// Edges followed
+			changed = 1;
+			const Instr* fc = code + ranges[f].first;
+			word n = ranges[f].count;
+			for (word i = 0; i < n; ++i)
+			{
+				word target = fc[i].target;
+				byte k = fc[i].reloc;
+				if (!k)
+				{
+					k = jump_operand(&fc[i]);
+					if (k && function_at((fc[i].bytes[k] | (fc[i].bytes[k + 1] << 8)) - OS_SIZE, nf) < nf)
+						return 0;
+					if (!k) k = load_operand(&fc[i]);
+				}
+				if (k)
+					target = (fc[i].bytes[k] | (fc[i].bytes[k + 1] << 8)) - OS_SIZE;
+				if (target == NO_POS) continue;
+				word t = function_at(target, nf);
+				if (t < nf && !reached[t]) reached[t] = 1;
+			}
+			FunctionAddress* fa = (FunctionAddress*)vector_access(functions, f);
+			word next = function_at(fa->stop, nf);
+			if ((n == 0 || !ends_flow(&fc[n - 1])) && next < nf && !reached[next])
+				reached[next] = 1;
+		}
+	}
+	return 1;
+}
+
+static byte* load_file(const char* filename, word* size)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f) return 0;
+	byte* data = (byte*)malloc(0x10000);
+	size_t n = fread(data, 1, 0x10000, f);
+	fclose(f);
+	*size = (word)n;
+	return data;
+}
+
+static byte decode_range(const byte* image, word start, word stop, byte* is_reloc, Instr* code, word* count)
+{
+	word pos = start;
+	while (pos < stop)
+	{
+		Instr* in = &code[*count];
+		in->pos = pos;
+		in->length = instr_length(image + pos, stop - pos);
+		in->reloc = 0;
+		in->label = 0;
+		for (byte k = 0; k < 4; ++k)
+			in->bytes[k] = k < in->length ? image[pos + k] : 0;
+		in->target = is_relative_jump(in) ? pos + 2 + (signed char)in->bytes[1] : NO_POS;
+		for (byte k = 1; k < in->length; ++k)
+		{
+			if (is_reloc[pos + k])
+			{
+				in->reloc = k;
+				is_reloc[pos + k] = 2;	// Moved with its instruction
+			}
+		}
+		pos += in->length;
+		++*count;
+	}
+	return pos == stop;
+}
+
+static void push_line_start(word line, word offset, void* context)
+{
+	(void)context;
+	word entry[2] = { line, offset };
+	vector_push(line_starts, entry);
+}
 
 void load_line_starts()
 {
-	FILE* f = fopen("line_offsets.log","r");
-	if (f)
+	trace_read("line_offsets.log", push_line_start, 0);
+}
+
+static void save_line_starts(const word* map, word size)
+{
+	static Trace t;
+	if (!trace_open(&t, "line_offsets.log")) return;
+	word n = vector_size(line_starts);
+	for (word i = 0; i < n; ++i)
+	{
+		word* entry = (word*)vector_access(line_starts, i);
+		word offset = entry[1] - OS_SIZE;
+		if (offset <= size) offset = map[offset];
+		trace_write(&t, entry[0], offset + OS_SIZE);
+	}
+	trace_close(&t);
+}
+
+void opt_init(Vector* functions_, Relocations* relocations_)
+{
+	functions = functions_;
+	relocations = relocations_;
+	bytes_saved = 0;
+	tstates_saved = 0;
+	rewrites = 0;
+	relaxed = 0;
+	removed = 0;
+	line_starts = vector_new(2 * sizeof(word));
+}
+
+void opt_exec(const char* filename)
+{
+	word size;
+	byte* image = load_file(filename, &size);
+	if (!image) return;
+	byte* is_reloc = (byte*)calloc(size + 1, 1);
+	byte* is_label = (byte*)calloc(size + 1, 1);
+	word* map = (word*)malloc((size + 1) * sizeof(word));
+	word* scratch = (word*)malloc(2 * (size + 1) * sizeof(word));
+	Instr* code = (Instr*)malloc((size + 1) * sizeof(Instr));
+	byte* out = (byte*)malloc(size + 1);
+	word nf = vector_size(functions);
+	Range* ranges = (Range*)malloc((nf + 1) * sizeof(Range));
+	byte* reached = (byte*)malloc(nf + 1);
+	word nr = relocations->count;
+	byte ok = 1;
+
+	// Jump targets: relocated addresses, relative jumps and function entries
+	for (word i = 0; i < nr; ++i)
+	{
+		word slot = relocations->offsets[i];
+		if (slot + 1 >= size) continue;
+		is_reloc[slot] = 1;
+		word target = (image[slot] | (image[slot + 1] << 8)) - OS_SIZE;
+		if (target <= size) is_label[target] = 1;
+	}
+	word count = 0;
+	for (word f = 0; f < nf && ok; ++f)
+	{
+		FunctionAddress* fa = (FunctionAddress*)vector_access(functions, f);
+		ranges[f].first = count;
+		ok = decode_range(image, fa->start, fa->stop, is_reloc, code, &count);
+		ranges[f].count = count - ranges[f].first;
+		is_label[fa->start] = 1;
+	}
+	for (word i = 0; i < count && ok; ++i)
 	{
-		while (!feof(f))
+		if (is_relative_jump(&code[i]))
 		{
-			word line, offset;
-			int rc = fscanf(f, "%hx %hx", &line, &offset);
-			if (rc == 2)
+			word target = code[i].pos + 2 + (signed char)code[i].bytes[1];
+			if (target <= size) is_label[target] = 1;
+		}
+	}
+	for (word i = 0; i < count; ++i)
+		code[i].label = is_label[code[i].pos];
+	if (ok) ok = find_reachable(image, size, is_reloc, code, ranges, nf, reached);
+
+	// Optimize each function in place, until no pattern applies.
+	// Unreachable functions are dropped and runtime routines kept as is
+	word total = 0;
+	for (word f = 0; f < nf && ok; ++f)
+	{
+		Instr* fc = code + ranges[f].first;
+		word n = ranges[f].count;
+		FunctionAddress* fa = (FunctionAddress*)vector_access(functions, f);
+		if (!reached[f])
+		{
+			n = 0;
+			++removed;
+		}
+		else
+		if (!fa->runtime)
+		{
+			byte changed = 1;
+			while (changed)
 			{
-				vector_push(line_starts, &offset);
+				changed = 0;
+				n = optimize_pass(fc, n, &changed);
 			}
+			relax_jumps(fc, n, fa->start, fa->stop, scratch, scratch + size + 1);
 		}
-		fclose(f);
+		// Compact into the shared array
+		for (word i = 0; i < n; ++i)
+			code[total + i] = fc[i];
+		ranges[f].first = total;
+		ranges[f].count = n;
+		total += n;
 	}
+
+	// Lay out the new image and build the old to new offset map
+	word src = 0, dst = 0;
+	for (word i = 0; i <= size; ++i) map[i] = NO_POS;
+	for (word f = 0; f < nf && ok; ++f)
+	{
+		FunctionAddress* fa = (FunctionAddress*)vector_access(functions, f);
+		for (; src < fa->start; ++src)
+		{
+			map[src] = dst;
+			out[dst++] = image[src];
+		}
+		word new_start = dst;
+		for (word i = 0; i < ranges[f].count; ++i)
+		{
+			Instr* in = &code[ranges[f].first + i];
+			in->new_pos = dst;
+			if (in->pos != NO_POS) map[in->pos] = dst;
+			for (byte k = 0; k < in->length; ++k)
+				out[dst++] = in->bytes[k];
+		}
+		src = fa->stop;
+		fa->start = new_start;
+		fa->stop = dst;
+	}
+	for (; src < size; ++src)
+	{
+		map[src] = dst;
+		out[dst++] = image[src];
+	}
+	map[size] = dst;
+	// Removed instructions map to the next instruction that was kept
+	for (word i = size; i > 0; --i)
+		if (map[i - 1] == NO_POS) map[i - 1] = map[i];
+
+	// Relative jumps
+	for (word i = 0; i < total && ok; ++i)
+	{
+		Instr* in = &code[i];
+		if (in->target == NO_POS) continue;
+		word target = in->target;
+		int disp = (int)map[target] - (int)(in->new_pos + 2);
+		if (disp < -128 || disp > 127) ok = 0;
+		out[in->new_pos + 1] = (byte)disp;
+	}
+
+	// Relocations: move the slots, then retarget the addresses in them
+	if (ok)
+	{
+		nr = 0;
+		for (word i = 0; i < size; ++i)
+			if (is_reloc[i] == 1) ++nr;
+		for (word i = 0; i < total; ++i)
+			if (code[i].reloc) ++nr;
+		if (nr > relocations->capacity)
+		{
+			word* offsets = (word*)realloc(relocations->offsets, nr * sizeof(word));
+			if (offsets)
+			{
+				relocations->offsets = offsets;
+				relocations->capacity = nr;
+			}
+			else ok = 0;
+		}
+	}
+	if (ok)
+	{
+		nr = 0;
+		for (word i = 0; i < size; ++i)
+		{
+			// Slots outside functions were copied as is
+			if (is_reloc[i] != 1) continue;
+			relocations->offsets[nr++] = map[i];
+		}
+		for (word i = 0; i < total; ++i)
+		{
+			if (!code[i].reloc) continue;
+			relocations->offsets[nr++] = code[i].new_pos + code[i].reloc;
+		}
+		relocations->count = nr;
+		for (word i = 0; i < nr; ++i)
+		{
+			word slot = relocations->offsets[i];
+			word value = out[slot] | (out[slot + 1] << 8);
+			if (value >= OS_SIZE && (value - OS_SIZE) <= size)
+			{
+				value = map[value - OS_SIZE] + OS_SIZE;
+				out[slot] = value & 0xFF;
+				out[slot + 1] = value >> 8;
+			}
+		}
+	}
+
+	if (ok)
+	{
+		FILE* f = fopen(filename, "wb");
+		if (f)
+		{
+			fwrite(out, 1, dst, f);
+			fclose(f);
+		}
+		load_line_starts();
+		save_line_starts(map, size);
+		bytes_saved = size - dst;
+#ifdef DEV
+		printf("Peephole: %d rewrites, %d jumps relaxed, %d functions removed, %d bytes and %lu T-states saved\n",
+			rewrites, relaxed, removed, bytes_saved, tstates_saved);
+#endif
+	}
+	else
+	{
+		bytes_saved = 0;
+		removed = 0;
+		tstates_saved = 0;
+	}
+	free(reached);
+	free(ranges);
+	free(out);
+	free(code);
+	free(scratch);
+	free(map);
+	free(is_label);
+	free(is_reloc);
+	free(image);
 }
 
-int main(int argc, char* argv[])
+void opt_shut()
 {
-	line_starts = vector_new(2);
-	vector_reserve(line_starts, 1024);
-	load_line_starts();
 	vector_shut(line_starts);
-	return 0;
-}
\ No newline at end of file
+	line_starts = 0;
+}
+
+word opt_bytes_saved()
+{
+	return bytes_saved;
+}
+
+unsigned long opt_tstates_saved()
+{
+	return tstates_saved;
+}
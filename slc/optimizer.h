@@ -6,8 +6,25 @@
 typedef struct function_address_
 {
 	word start,stop;
+	byte runtime;	// Hand written routine, only removed when unreachable
 } FunctionAddress;
 
-void opt_init(Vector* functions, Vector* global_addresses);
+// Offsets of the absolute address operands in the image.  Host only data,
+// so it is allocated outside the compiler heap
+typedef struct relocations_
+{
+	word*	offsets;
+	word	count,capacity;
+} Relocations;
+
+// Peephole pass over the generated image (host only).
+// functions holds the code ranges to optimize, relocations the offsets
+// of every absolute address operand in the image.  Both are updated
+// to the optimized layout.  Functions that cannot be reached from the
+// entry jump are left out of the image.
+void opt_init(Vector* functions, Relocations* relocations);
 void opt_exec(const char* filename);
 void opt_shut();
+
+word opt_bytes_saved();
+unsigned long opt_tstates_saved();
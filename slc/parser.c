@@ -2,8 +2,11 @@
 #include "strhash.h"
 #include "memory.h"
 #include "vector.h"
+#include "arena.h"
+#include "stats.h"
 
 #define CONTEXT_LIMIT 16
+#define NODE_CHUNK (8 * sizeof(Node))
 
 #define ERROR_RET(msg)  return error_func(node, msg)
 //#define VERIFY(x,y) if (x!=y) ERROR_RET;
@@ -20,6 +23,7 @@ const char* MISSING_TOKEN="Missing token";
 const char* EXPECTING_PARAM="Expecting parameter";
 const char* EXPECT_COMMA="Expecting comma";
 const char* BAD_FUNCTION="Bad function";
+const char* OUT_OF_MEMORY="Out of memory";
 
 typedef struct constant_
 {
@@ -28,8 +32,10 @@ typedef struct constant_
 } Constant;
 
 Vector* constants;
+Arena* nodes;		// Nodes of the current top level construct
 Node root_node;
 Node* cur_node=0;
+Node* cur_tail=0;	// Last child of cur_node, so statements are appended in O(1)
 
 typedef Node* (*state)();
 
@@ -37,6 +43,7 @@ typedef struct context_
 {
 	state	ctx_state;
 	Node*	node;
+	Node*	tail;
 } Context;
 
 void error_exit(word line, const char* msg, int rc);
@@ -70,28 +77,32 @@ void init_node(Node* node, Node* parent)
 
 Node* allocate_node(byte type, Node* parent)
 {
-	Node* new_node = (Node*)allocate(sizeof(Node));
+	Node* new_node = (Node*)arena_alloc(nodes, sizeof(Node));
+	if (!new_node)
+	{
+		error_exit(line_number, OUT_OF_MEMORY, 1);
+		return 0;
+	}
+	STAT_INC(nodes_allocated);
 	init_node(new_node, parent);
 	new_node->type = type;
 	new_node->line=line_number;
 	return new_node;
 }
 
-void release_node(Node* node)
+// Nodes are owned by the arena, only global array data is allocated separately
+void p_release(Node* node)
 {
-	if (!node) return;
-	if (node->child) release_node(node->child);
-	if (node->sibling) release_node(node->sibling);
-	if (node->parameters) release_node(node->parameters);
-	if (node->data) vector_shut(node->data);
-	release(node);
+	if (node && node->data) vector_shut(node->data);
+	arena_reset(nodes);
+	STAT_ADD(nodes_freed, stats.nodes_allocated - stats.nodes_freed);
 }
 
 
 Node* error_func(Node* node, const char* msg)
 {
+	(void)node;
 	error_exit(line_number,msg, 1);
-	if (node) release_node(node);
 	return 0;
 }
 
@@ -123,7 +134,9 @@ void push_context(state c, Node* node)
 		++context_depth;
 		context_stack[context_depth].ctx_state = c;
 		context_stack[context_depth].node = cur_node;
+		context_stack[context_depth].tail = cur_tail;
 		cur_node = node;
+		cur_tail = 0;
 	}
 	else
 		error = 1;
@@ -134,6 +147,7 @@ void pop_context()
 	if (context_depth > 0)
 	{
 		cur_node = context_stack[context_depth].node;
+		cur_tail = context_stack[context_depth].tail;
 		--context_depth;
 	}
 	else
@@ -164,26 +178,29 @@ void add_child(Node* parent, Node* child)
 	}
 }
 
-void add_parameter(Node* node, Node* param)
+// Append a statement / field to the current block in O(1)
+void add_to_block(Node* node)
 {
-	Node* last_param = node->parameters;
-	if (!last_param) node->parameters = param;
-	else
-	{
-		Node* next_param = last_param->sibling;
-		while (next_param)
-		{
-			last_param = next_param;
-			next_param = last_param->sibling;
-		}
-		last_param->sibling = param;
-	}
+	if (cur_tail) cur_tail->sibling = node;
+	else add_child(cur_node, node);
+	cur_tail = node;
+}
+
+// Append param after last, the previously appended parameter (0 for the first one).
+// Returns param, to be passed as last for the next parameter
+Node* add_parameter(Node* node, Node* last, Node* param)
+{
+	if (!last) node->parameters = param;
+	else last->sibling = param;
+	return param;
 }
 
 void release_root()
 {
-	if (root_node.child) release_node(root_node.child);
+	for (Node* node = root_node.child; node; node = node->sibling)
+		if (node->data) vector_shut(node->data);
 	root_node.child = 0;
+	arena_reset(nodes);
 }
 
 Node* parse_lvalue();
@@ -215,7 +232,7 @@ Node* parse_lvalue()
 	if (t.type == LPAREN)
 	{
 		cur_index -= 2; // Undo ident and LPAREN
-		release_node(node);
+		arena_free_last(nodes, node);
 		node = parse_call();
 		if (!node) ERROR_RET("Failed to parse call");
 		return node;
@@ -279,7 +296,8 @@ Node* parse_expression()
 	if (!node) return 0;
 	NEXT_TOKEN;
 	if (t.type == PLUS || t.type == MINUS || t.type == LSH || t.type == RSH ||
-		t.type == AMP || t.type == PIPE || t.type==CARET)
+		t.type == AMP || t.type == PIPE || t.type==CARET ||
+		t.type == STAR || t.type == SLASH || t.type == PERCENT)
 	{
 		Node* oper = allocate_node(t.type, 0);
 		add_child(oper, node);
@@ -326,6 +344,33 @@ Node* parse_condition()
 	return node;
 }
 
+// Conditions joined by & and |, combined left to right
+Node* parse_compound_condition()
+{
+	Token t;
+	Node* node = parse_condition();
+	if (!node) return 0;
+	while (1)
+	{
+		NEXT_TOKEN;
+		if (t.type == EOL)
+		{
+			--cur_index;
+			break;
+		}
+		if (t.type == PIPE || t.type == AMP)
+		{
+			Node* combined=allocate_node(t.type,0);
+			add_child(combined, node);
+			Node* cond = parse_condition();
+			if (!cond) ERROR_RET(BAD_EXPRESSION);
+			add_child(combined, cond);
+			node = combined;
+		}
+	}
+	return node;
+}
+
 Node* parse_call()
 {
 	Token t;
@@ -334,6 +379,7 @@ Node* parse_call()
 	node->name = t.value;
 	EXPECT(LPAREN);
 	byte param_count = 0;
+	Node* last = 0;
 	while (1)
 	{
 		NEXT_TOKEN;
@@ -345,7 +391,7 @@ Node* parse_call()
 		else --cur_index;
 		Node* param = parse_expression();
 		if (!param) ERROR_RET(BAD_EXPRESSION);
-		add_parameter(node, param);
+		last = add_parameter(node, last, param);
 		++param_count;
 	}
 }
@@ -363,7 +409,7 @@ Node* parse_statement()
 		node = allocate_node(RETURN, 0);
 		Node* expr = parse_expression();
 		if (expr)
-			add_parameter(node, expr);
+			add_parameter(node, 0, expr);
 	}
 	else
 	if (t.type == VAR)
@@ -396,37 +442,18 @@ Node* parse_statement()
 	if (t.type == WHILE)
 	{
 		node = allocate_node(WHILE, 0);
-		Node* cond = parse_condition();
+		Node* cond = parse_compound_condition();
 		if (!cond) ERROR_RET(BAD_EXPRESSION);
-		add_parameter(node, cond);
+		add_parameter(node, 0, cond);
 		new_block = 1;
 	}
 	else
 	if (t.type == IF)
 	{
 		node = allocate_node(IF, 0);
-		Node* cond = parse_condition();
+		Node* cond = parse_compound_condition();
 		if (!cond) ERROR_RET(BAD_EXPRESSION);
-		while (1)
-		{
-			NEXT_TOKEN;
-			if (t.type == EOL)
-			{
-				--cur_index;
-				break;
-			}
-			if (t.type == PIPE || t.type == AMP)
-			{
-				Node* combined=allocate_node(t.type,0);
-				add_child(combined, cond);
-				cond = parse_condition();
-				if (!cond) ERROR_RET(BAD_EXPRESSION);
-				add_child(combined, cond);
-				cond = combined;
-			}
-		}
-		if (!cond) ERROR_RET(BAD_EXPRESSION);
-		add_parameter(node, cond);
+		add_parameter(node, 0, cond);
 		new_block = 1;
 	}
 	else
@@ -441,6 +468,7 @@ Node* parse_statement()
 		Node* false_side = allocate_node(BLOCK, 0);
 		add_child(cur_node, false_side);
 		cur_node = false_side;
+		cur_tail = 0;
 	}
 	else
 	if (t.type == END)
@@ -452,7 +480,7 @@ Node* parse_statement()
 	EXPECT(EOL);
 	if (node)
 	{
-		add_child(cur_node, node);
+		add_to_block(node);
 		if (new_block)
 			push_context(parse_statement, node);
 		return node;
@@ -468,6 +496,7 @@ Node* parse_fun()
 	node->name = t.value;
 	EXPECT(LPAREN);
 	byte param_count = 0;
+	Node* last = 0;
 	while (1)
 	{
 		// Peek to see next token
@@ -486,7 +515,7 @@ Node* parse_fun()
 		}
 		Node* parameter = parse_var();
 		if (!parameter) ERROR_RET(BAD_VARIABLE);
-		add_parameter(node, parameter);
+		last = add_parameter(node, last, parameter);
 		++param_count;
 	}
 }
@@ -506,7 +535,7 @@ Node* parse_var()
 		{
 			Node* length_node = allocate_node(NUMBER, 0);
 			length_node->name = t.value;
-			add_parameter(node, length_node);
+			add_parameter(node, 0, length_node);
 			NEXT_TOKEN;
 		}
 		else
@@ -541,7 +570,7 @@ Node* parse_struct_var()
 		node = parse_var();
 		if (!node) ERROR_RET(BAD_VARIABLE);
 		EXPECT(EOL);
-		add_child(cur_node, node);
+		add_to_block(node);
 	}
 	else
 	if (t.type == END)
@@ -599,22 +628,22 @@ Node* parse_global()
 				EXPECT(NUMBER);
 				Node* value = allocate_node(NUMBER, 0);
 				value->name = t.value;
-				add_parameter(node, value);
+				add_parameter(node, 0, value);
 			}
 		}
 		else --cur_index;
 		EXPECT(EOL);
 		add_child(cur_node, node);
 	}
-	else if (t.type == FUN || t.type == WFUN || extrn)
+	else if (t.type == FUN || t.type == WFUN || t.type == FAST || extrn)
 	{
-		if (extrn)
-		{
-			NEXT_TOKEN;
-			if (t.type!=FUN && t.type!=WFUN) ERROR_RET(BAD_FUNCTION);
-		}
+		if (extrn) NEXT_TOKEN;
+		byte fast = (t.type == FAST ? 1 : 0);
+		if (fast) NEXT_TOKEN;
+		if (t.type!=FUN && t.type!=WFUN) ERROR_RET(BAD_FUNCTION);
 		node = parse_fun();
 		if (!node) ERROR_RET(BAD_FUNCTION);
+		if (fast) node->type = FAST; // Register calling convention
 		node->data_type.type = VAR;
 		node->data_type.sub_type = PRIMITIVE;
 		node->data_type.type_name = (t.type==FUN ? BYTE : WORD);
@@ -653,6 +682,7 @@ Node* parse_global()
 void p_init(token_func f)
 {
 	constants = vector_new(sizeof(Constant));
+	nodes = arena_new(NODE_CHUNK);
 	error = 0;
 	get_lex_token = f;
 	init_node(&root_node, 0);
@@ -665,12 +695,15 @@ void p_init(token_func f)
 void p_shut()
 {
 	release_root();
+	arena_shut(nodes);
+	STAT_ADD(nodes_freed, stats.nodes_allocated - stats.nodes_freed);
 	vector_shut(constants);
 }
 
 Node* p_parse()
 {
 	Node* res=0;
+	STATS_ENTER(PHASE_PARSE);
 	while (error == 0)
 	{
 		state current = context();
@@ -682,6 +715,9 @@ Node* p_parse()
 			break;
 		}
 	}
+	// The declaration is complete, its last chunk has no more nodes to take
+	if (res) arena_trim(nodes);
+	STATS_LEAVE();
 	return (error == 0 ? res : 0);
 }
 
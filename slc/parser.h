@@ -32,4 +32,6 @@ void p_init(token_func f);
 Node* p_parse();
 Node* p_root();
 void p_shut();
-void release_node(Node* node);
\ No newline at end of file
+// Release a top level node returned by p_parse, with all the nodes
+// allocated since the previous one
+void p_release(Node* node);
\ No newline at end of file
@@ -128,7 +128,9 @@ def process(line: str, last_line: str):
         del stack[-1]
         return '};'
     if line.startswith('extern'):
-        return process_function(line[6:].strip(), True)
+        return process_function(re.sub(r'^fast\s+', '', line[6:].strip()), True)
+    if line.startswith('fast '):
+        return process_function(line[5:].strip(), False)
     if line.startswith('fun '):
         return process_function(line, False)
     if line.startswith('while '):
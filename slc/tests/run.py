@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# Compiles a test program, runs it in the Z80 emulator and compares the
+# GPU stream with the '# expect:' lines of the source (decimal bytes)
+import argparse
+import os.path
+import shutil
+import subprocess as sp
+import sys
+import tempfile
+from typing import List
+
+TSTATES_LIMIT = 100000000
+
+
+def read_expected(source: str) -> List[int]:
+    res = []
+    for line in open(source).readlines():
+        if line.startswith('# expect:'):
+            res += [int(x) for x in line.split()[2:]]
+    return res
+
+
+def main(source: str, slc: str = 'slc', emu: str = 'z80emu'):
+    slc = os.path.abspath(slc) if os.path.exists(slc) else slc
+    emu = os.path.abspath(emu) if os.path.exists(emu) else emu
+    expected = read_expected(source)
+    with tempfile.TemporaryDirectory() as workdir:
+        # The compiler keeps at most 32 characters of the source name
+        shutil.copy(source, os.path.join(workdir, 'test.sl'))
+        compiled = sp.run([slc, 'test.sl'], cwd=workdir, stdout=sp.PIPE, stderr=sp.STDOUT, text=True)
+        if compiled.returncode != 0:
+            print(compiled.stdout)
+            sys.exit(1)
+        ran = sp.run([emu, '-t', str(TSTATES_LIMIT), '-g', 'test.gpu', 'out.bin'],
+                     cwd=workdir, stdout=sp.PIPE, stderr=sp.STDOUT, text=True)
+        if 'exit main' not in ran.stdout.splitlines():
+            print(ran.stdout)
+            sys.exit(1)
+        output = list(open(os.path.join(workdir, 'test.gpu'), 'rb').read())
+    if output != expected:
+        first = next((i for i, (a, b) in enumerate(zip(output, expected)) if a != b), min(len(output), len(expected)))
+        print(f'Output differs at byte {first}: {output[first:first + 8]} expected {expected[first:first + 8]}')
+        print(f'{len(output)} bytes written, {len(expected)} expected')
+        sys.exit(1)
+    print(f'{len(output)} bytes as expected')
+
+
+if __name__ == '__main__':
+    # argparse rather than argh, so ctest runs with a bare interpreter
+    parser = argparse.ArgumentParser()
+    parser.add_argument('source')
+    parser.add_argument('--slc', default='slc')
+    parser.add_argument('--emu', default='z80emu')
+    args = parser.parse_args()
+    main(args.source, args.slc, args.emu)
@@ -0,0 +1,18 @@
+# Reader for the binary traces written by DEV builds (utils/trace.h):
+# fixed records of two little endian 16 bit words
+import struct
+from typing import List, Tuple
+
+RELEASE = 0x8000  # alloc.log: set in the size of a release record
+
+Record = Tuple[int, int]
+
+
+def read_records(filename: str) -> List[Record]:
+    data = open(filename, 'rb').read()
+    return list(struct.iter_unpack('<HH', data[:len(data) & ~3]))
+
+
+# alloc.log as (allocate, block size, offset) tuples
+def read_alloc_trace(filename: str) -> List[Tuple[bool, int, int]]:
+    return [((size & RELEASE) == 0, size & ~RELEASE, offset) for size, offset in read_records(filename)]
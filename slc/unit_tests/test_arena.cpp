@@ -0,0 +1,80 @@
+#include "gtest/gtest.h"
+extern "C" {
+#include <arena.h>
+#include <memory.h>
+}
+
+struct Initializer
+{
+	Initializer()
+	{
+		alloc_init();
+	}
+	~Initializer()
+	{
+		alloc_shut();
+	}
+};
+
+TEST(arena, alloc_reset)
+{
+	Arena* a = arena_new(128);
+	void* null = 0;
+	byte* first = (byte*)arena_alloc(a, 10);
+	EXPECT_NE(first, null);
+	byte* second = (byte*)arena_alloc(a, 10);
+	EXPECT_GE(second, first + 10);
+	// Larger than a chunk
+	EXPECT_NE(arena_alloc(a, 1000), null);
+	for (int i = 0; i < 100; ++i)
+		EXPECT_NE(arena_alloc(a, 24), null);
+	unsigned used = get_total_allocated();
+	arena_reset(a);
+	EXPECT_LT(get_total_allocated(), used);
+	EXPECT_TRUE(verify_heap());
+	arena_shut(a);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+TEST(arena, trim)
+{
+	Arena* a = arena_new(1000);
+	byte* first = (byte*)arena_alloc(a, 100);
+	for (int i = 0; i < 100; ++i) first[i] = (byte)i;
+	unsigned used = get_total_allocated();
+	arena_trim(a);
+	EXPECT_LE(get_total_allocated(), used - 800);
+	EXPECT_TRUE(verify_heap());
+	for (int i = 0; i < 100; ++i) EXPECT_EQ(first[i], (byte)i);
+	// Full chunk, nothing to trim
+	arena_trim(a);
+	byte* second = (byte*)arena_alloc(a, 10);
+	EXPECT_NE(second, nullptr);
+	EXPECT_TRUE(verify_heap());
+	arena_reset(a);
+	arena_shut(a);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+TEST(arena, free_last)
+{
+	Arena* a = arena_new(64);
+	byte* first = (byte*)arena_alloc(a, 16);
+	byte* second = (byte*)arena_alloc(a, 16);
+	arena_free_last(a, second);
+	EXPECT_EQ(arena_alloc(a, 16), second);
+	// Not allocated by the arena, nothing changes
+	byte other[16];
+	arena_free_last(a, other);
+	EXPECT_EQ(arena_alloc(a, 16), second + 16);
+	EXPECT_EQ(second, first + 16);
+	arena_shut(a);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+int main(int argc, char* argv[])
+{
+	Initializer init;
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
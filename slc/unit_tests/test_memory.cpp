@@ -40,10 +40,110 @@ TEST(memory, alloc_free)
 	}
 }
 
+TEST(memory, mixed_sizes)
+{
+	// Mix of small (binned) and large (free list) blocks, released in
+	// scattered order.  Contents must survive and the heap must stay consistent.
+	const int N = 200;
+	byte* blocks[N];
+	word sizes[N];
+	unsigned seed = 12345;
+	for (int i = 0; i < N; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		sizes[i] = (i % 3 == 0) ? (word)(64 + (seed >> 16) % 200) : (word)(1 + (seed >> 16) % 60);
+		blocks[i] = (byte*)allocate(sizes[i]);
+		ASSERT_NE(blocks[i], null);
+		for (word j = 0; j < sizes[i]; ++j) blocks[i][j] = (byte)i;
+	}
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (int i = pass; i < N; i += 2)
+		{
+			for (word j = 0; j < sizes[i]; ++j) ASSERT_EQ(blocks[i][j], (byte)i);
+			release(blocks[i]);
+			EXPECT_TRUE(verify_heap());
+			if (pass == 0)
+			{
+				sizes[i] = sizes[(i + 7) % N];
+				blocks[i] = (byte*)allocate(sizes[i]);
+				ASSERT_NE(blocks[i], null);
+				for (word j = 0; j < sizes[i]; ++j) blocks[i][j] = (byte)i;
+				EXPECT_TRUE(verify_heap());
+			}
+		}
+	}
+	for (int i = 0; i < N; i += 2)
+		release(blocks[i]);
+	EXPECT_TRUE(verify_heap());
+}
+
+TEST(memory, shrink)
+{
+	byte* a = (byte*)allocate(500);
+	byte* b = (byte*)allocate(500);
+	for (word i = 0; i < 500; ++i) a[i] = (byte)i;
+	unsigned used = get_total_allocated();
+	shrink(a, 100);
+	EXPECT_EQ(get_total_allocated(), used - 400);
+	EXPECT_TRUE(verify_heap());
+	for (word i = 0; i < 100; ++i) ASSERT_EQ(a[i], (byte)i);
+	// The released end is reused
+	byte* c = (byte*)allocate(300);
+	EXPECT_GT(c, a);
+	EXPECT_LT(c, b);
+	// Too little left for a free block
+	used = get_total_allocated();
+	shrink(c, 298);
+	EXPECT_EQ(get_total_allocated(), used);
+	// At the top of the heap
+	shrink(b, 10);
+	EXPECT_TRUE(verify_heap());
+	release(c);
+	release(b);
+	release(a);
+	EXPECT_TRUE(verify_heap());
+}
+
+TEST(memory, extend)
+{
+	// Larger than any free block left by the other tests, so both come
+	// from the top of the heap
+	byte* a = (byte*)allocate(2000);
+	byte* b = (byte*)allocate(2000);
+	ASSERT_EQ(b, a + 2002);
+	for (word i = 0; i < 2000; ++i) b[i] = (byte)i;
+	unsigned used = get_total_allocated();
+	EXPECT_TRUE(extend(b, 200));
+	EXPECT_EQ(get_total_allocated(), used + 200);
+	for (word i = 0; i < 2000; ++i) ASSERT_EQ(b[i], (byte)i);
+	// Followed by an allocated block
+	EXPECT_FALSE(extend(a, 10));
+	byte* c = (byte*)allocate(3000);
+	release(b);
+	// Into the free block after it, leaving the rest free
+	EXPECT_TRUE(extend(a, 2));
+	EXPECT_TRUE(extend(a, 1000));
+	EXPECT_TRUE(verify_heap());
+	// Too little would be left of the free block
+	EXPECT_FALSE(extend(a, 1198));
+	EXPECT_TRUE(extend(a, 1200));
+	EXPECT_FALSE(extend(a, 2));
+	EXPECT_TRUE(verify_heap());
+	release(c);
+	release(a);
+	EXPECT_TRUE(verify_heap());
+}
+
 TEST(memory, edge_cases)
 {
 	EXPECT_EQ(allocate(0),null);
 	EXPECT_EQ(allocate(0x8000),null);
+	// Sizes where the header and rounding would wrap around
+	EXPECT_EQ(allocate(0xFFFF),null);
+	EXPECT_EQ(allocate(0xFFFE),null);
+	EXPECT_EQ(allocate(0xFFFD),null);
+	EXPECT_TRUE(verify_heap());
 }
 
 int main(int argc, char* argv[])
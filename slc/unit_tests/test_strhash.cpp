@@ -0,0 +1,89 @@
+#include "gtest/gtest.h"
+#include <string>
+extern "C" {
+#include <strhash.h>
+#include <memory.h>
+}
+
+struct Initializer
+{
+	Initializer()
+	{
+		alloc_init();
+	}
+	~Initializer()
+	{
+		alloc_shut();
+	}
+};
+
+TEST(strhash, get)
+{
+	StrHash* sh = sh_init();
+	word a = sh_get(sh, "ab");
+	word b = sh_get(sh, "ba");
+	EXPECT_NE(a, b);
+	EXPECT_NE(sh_get(sh, "cx"), sh_get(sh, "cy"));
+	EXPECT_EQ(sh_get(sh, "ab"), a);
+	EXPECT_EQ(sh_get(sh, "ba"), b);
+	sh_shut(sh);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+TEST(strhash, text)
+{
+	StrHash* sh = sh_init();
+	char buffer[20];
+	word t = sh_temp(sh);
+	word id = sh_get(sh, "main");
+	EXPECT_NE(t, id);
+	EXPECT_TRUE(sh_text(sh, buffer, id));
+	EXPECT_STREQ(buffer, "main");
+	EXPECT_FALSE(sh_text(sh, buffer, t));
+	EXPECT_FALSE(sh_text(sh, buffer, id + 1));
+	byte length = 0;
+	EXPECT_STREQ(sh_view(sh, id, &length), "main");
+	EXPECT_EQ(length, 4);
+	EXPECT_EQ(sh_view(sh, t, &length), nullptr);
+	sh_shut(sh);
+}
+
+TEST(strhash, temp)
+{
+	StrHash* sh = sh_init();
+	word id = sh_get(sh, "main");
+	unsigned allocated = get_total_allocated();
+	word t = sh_temp(sh);
+	for (int i = 0; i < 1000; ++i)
+		EXPECT_NE(sh_temp(sh), t);
+	EXPECT_EQ(get_total_allocated(), allocated);
+	EXPECT_NE(sh_get(sh, "next"), t);
+	EXPECT_EQ(sh_get(sh, "main"), id);
+	sh_shut(sh);
+}
+
+TEST(strhash, growth)
+{
+	StrHash* sh = sh_init();
+	word ids[1000];
+	for (int i = 0; i < 1000; ++i)
+		ids[i] = sh_get(sh, ("id" + std::to_string(i)).c_str());
+	char buffer[20];
+	for (int i = 0; i < 1000; ++i)
+	{
+		std::string name = "id" + std::to_string(i);
+		EXPECT_EQ(sh_get(sh, name.c_str()), ids[i]);
+		EXPECT_TRUE(sh_text(sh, buffer, ids[i]));
+		EXPECT_EQ(name, buffer);
+	}
+	EXPECT_TRUE(verify_heap());
+	sh_shut(sh);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+int main(int argc, char* argv[])
+{
+	Initializer init;
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
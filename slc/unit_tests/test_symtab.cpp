@@ -0,0 +1,71 @@
+#include "gtest/gtest.h"
+extern "C" {
+#include <symtab.h>
+#include <memory.h>
+}
+
+struct Initializer
+{
+	Initializer()
+	{
+		alloc_init();
+	}
+	~Initializer()
+	{
+		alloc_shut();
+	}
+};
+
+TEST(symtab, get_set)
+{
+	SymTab* t = symtab_new();
+	word value = 0;
+	EXPECT_FALSE(symtab_get(t, 5, &value));
+	for (word name = 1; name < 500; ++name)
+		EXPECT_TRUE(symtab_set(t, name, name * 3));
+	EXPECT_EQ(symtab_size(t), 499);
+	for (word name = 1; name < 500; ++name)
+	{
+		EXPECT_TRUE(symtab_get(t, name, &value));
+		EXPECT_EQ(value, name * 3);
+	}
+	EXPECT_FALSE(symtab_get(t, 500, &value));
+	symtab_shut(t);
+	EXPECT_EQ(get_total_allocated(), 0);
+}
+
+TEST(symtab, scopes)
+{
+	SymTab* t = symtab_new();
+	word value = 0;
+	for (word name = 1; name <= 20; ++name)
+		symtab_set(t, name, 0);
+	symtab_push(t);
+	// Shadow some names, add many new ones to force removals across probe chains
+	for (word name = 10; name <= 300; ++name)
+		symtab_set(t, name, 1);
+	symtab_push(t);
+	symtab_set(t, 15, 2);
+	EXPECT_TRUE(symtab_get(t, 15, &value));
+	EXPECT_EQ(value, 2);
+	symtab_pop(t);
+	EXPECT_TRUE(symtab_get(t, 15, &value));
+	EXPECT_EQ(value, 1);
+	symtab_pop(t);
+	EXPECT_EQ(symtab_size(t), 20);
+	for (word name = 1; name <= 20; ++name)
+	{
+		EXPECT_TRUE(symtab_get(t, name, &value));
+		EXPECT_EQ(value, 0);
+	}
+	for (word name = 21; name <= 300; ++name)
+		EXPECT_FALSE(symtab_get(t, name, &value));
+	symtab_shut(t);
+}
+
+int main(int argc, char* argv[])
+{
+	Initializer init;
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
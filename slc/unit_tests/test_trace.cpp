@@ -0,0 +1,49 @@
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <vector>
+extern "C" {
+#include <trace.h>
+}
+
+typedef std::vector<std::pair<word, word>> Records;
+
+static void collect(word a, word b, void* context)
+{
+	((Records*)context)->push_back(std::make_pair(a, b));
+}
+
+TEST(trace, write_read)
+{
+	static Trace t;
+	ASSERT_TRUE(trace_open(&t, "test_trace.bin"));
+	// More than one buffer of records
+	for (word i = 0; i < 1000; ++i)
+		trace_write(&t, i, i ^ TRACE_RELEASE);
+	trace_close(&t);
+	Records records;
+	EXPECT_TRUE(trace_read("test_trace.bin", collect, &records));
+	ASSERT_EQ(records.size(), 1000u);
+	for (word i = 0; i < 1000; ++i)
+	{
+		EXPECT_EQ(records[i].first, i);
+		EXPECT_EQ(records[i].second, i ^ TRACE_RELEASE);
+	}
+	remove("test_trace.bin");
+}
+
+TEST(trace, disabled)
+{
+	static Trace t;
+	ASSERT_TRUE(trace_open(&t, "test_trace.bin"));
+	trace_write(&t, 1, 2);
+	trace_close(&t);
+	trace_enable(0);
+	EXPECT_FALSE(trace_open(&t, "test_trace.bin"));
+	trace_write(&t, 3, 4);
+	trace_close(&t);
+	trace_enable(1);
+	// The stale file of the enabled run is removed
+	Records records;
+	EXPECT_FALSE(trace_read("test_trace.bin", collect, &records));
+	EXPECT_TRUE(records.empty());
+}
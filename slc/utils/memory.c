@@ -1,7 +1,9 @@
 #include "memory.h"
+#include "stats.h"
 #ifdef DEV
 #include <stdio.h>
-static FILE* logfile=0;
+#include "trace.h"
+static Trace alloc_trace;
 #endif
 
 #define HEAP_SIZE 0x7000
@@ -10,6 +12,15 @@ static word total_allocated = 0;
 static word heap=0;
 static word free_block = 0xFFFF;
 
+// Blocks up to SMALL_LIMIT bytes (header included) are recycled through
+// exact size bins with O(1) push/pop.  This covers the common small
+// structures (Node, Token, Address, Variable, Vector header).
+// Larger blocks live in an address ordered free list, with best fit
+// allocation and coalescing of neighbours on release.
+#define SMALL_LIMIT 64
+#define BIN_COUNT ((SMALL_LIMIT >> 1) + 1)
+static word bins[BIN_COUNT];
+
 byte check_heap(word size)
 {
 	return (heap + size) <= HEAP_SIZE;
@@ -37,16 +48,17 @@ void* get_pointer(word offset)
 
 void alloc_init()
 {
+	for (word i = 0; i < BIN_COUNT; ++i)
+		bins[i] = 0xFFFF;
 #ifdef DEV
-	logfile=fopen("alloc.log","w");
+	trace_open(&alloc_trace, "alloc.log");
 #endif
 }
 
 void alloc_shut()
 {
 #ifdef DEV
-	if (logfile)
-		fclose(logfile);
+	trace_close(&alloc_trace);
 #endif
 }
 
@@ -58,8 +70,11 @@ void* find_free_block(word size)
 	word prev = 0xFFFF;
 	word current = free_block;
 	word* best_ptr=0;
+	STAT_LOCAL(steps);
+	STAT_INC(free_list_searches);
 	while (current != 0xFFFF)
 	{
+		STAT_STEP(steps);
 		word* ptr=(word*)get_pointer(current);
 		word block_size = *ptr;
 		if (block_size >= size)
@@ -80,6 +95,8 @@ void* find_free_block(word size)
 		prev=current;
 		current=ptr[1];
 	}
+	STAT_ADD(free_list_steps, steps);
+	STAT_MAX(free_list_max_steps, steps);
 	if (best == 0xFFFF) return 0;
 	if (best_diff > 0)
 	{
@@ -99,18 +116,63 @@ void* find_free_block(word size)
 	return best_ptr;
 }
 
+static void push_bin(word offset, word size)
+{
+	word* ptr = (word*)get_pointer(offset);
+	ptr[0] = size;
+	ptr[1] = bins[size >> 1];
+	bins[size >> 1] = offset;
+}
+
+static void* pop_bin(word size)
+{
+	word offset = bins[size >> 1];
+	if (offset == 0xFFFF) return 0;
+	word* ptr = (word*)get_pointer(offset);
+	bins[size >> 1] = ptr[1];
+	return ptr;
+}
+
+// Last resort for small sizes when the heap is exhausted:
+// split a block from a larger bin
+static void* split_bin(word size)
+{
+	for (word bin_size = size + 2 * sizeof(word); bin_size <= SMALL_LIMIT; bin_size += 2)
+	{
+		word* ptr = (word*)pop_bin(bin_size);
+		if (ptr)
+		{
+			STAT_INC(bin_splits);
+			push_bin(get_offset(ptr) + size, bin_size - size);
+			return ptr;
+		}
+	}
+	return 0;
+}
+
 void* allocate(word size)
 {
+	STAT_INC(allocate_calls);
 	if (size==0) return 0;
+	if (size > 0xFFFF - sizeof(word) - 1) return 0; // header and rounding would overflow
 	if (size<sizeof(word))
 		size=sizeof(word); // minimum allocation is sizeof(word)
-	size += sizeof(word);
-	void* best_free_block=find_free_block(size);
+	size += sizeof(word) + (size & 1); // header, and keep blocks word aligned
+	void* best_free_block = 0;
+	if (size <= SMALL_LIMIT)
+		best_free_block = pop_bin(size);
+	if (!best_free_block)
+		best_free_block = find_free_block(size);
 	if (!best_free_block)
 	{
-		if (!check_heap(size)) return 0;
-		best_free_block = get_pointer(heap);
-		heap += size;
+		if (check_heap(size))
+		{
+			best_free_block = get_pointer(heap);
+			heap += size;
+		}
+		else if (size <= SMALL_LIMIT)
+			best_free_block = split_bin(size);
+		if (!best_free_block) return 0;
 	}
 	word* header = (word*)best_free_block;
 	*header = size;
@@ -121,88 +183,157 @@ void* allocate(word size)
 	}
 	word offset= get_offset(best_free_block);
 #ifdef DEV
-	if (logfile)
-		fprintf(logfile,"A %hd %hd\n",size,offset);
+	trace_write(&alloc_trace, size, offset);
 #endif
 	return header + 1;
 }
 
-void sort_free_blocks()
+// Insert a block into the address ordered free list, merging it with
+// adjacent free blocks.  A block that ends up at the top of the heap
+// is returned to the heap instead.
+static void insert_free_block(word offset, word size)
 {
-	// Bubble sort list by offset
-	word swaps=1;
-	while (swaps > 0)
+	word before = 0xFFFF; // Predecessor of prev
+	word prev = 0xFFFF;
+	word current = free_block;
+	STAT_INC(free_list_inserts);
+	while (current != 0xFFFF && current < offset)
 	{
-		swaps=0;
-		word prev=0xFFFF;
-		word current = free_block;
-		while (current != 0xFFFF)
-		{
-			word* cur_ptr=(word*)get_pointer(current);
-			word next=cur_ptr[1];
-			if (next<current)
-			{
-				word* next_ptr=(word*)get_pointer(next);
-				if (prev==0xFFFF) free_block=next;
-				else
-				{
-					word* prev_ptr=(word*)get_pointer(prev);
-					prev_ptr[1]=next;
-				}
-				cur_ptr[1]=next_ptr[1];
-				next_ptr[1]=current;
-				swaps++;
-			}
-			prev=current;
-			current=next;
-		}
+		STAT_INC(free_list_insert_steps);
+		before = prev;
+		prev = current;
+		current = ((word*)get_pointer(current))[1];
 	}
-}
-
-void unite_free_blocks()
-{
-	word current = free_block;
-	while (current != 0xFFFF)
+	word* ptr = (word*)get_pointer(offset);
+	ptr[0] = size;
+	ptr[1] = current;
+	if (current != 0xFFFF && (offset + size) == current)
+	{
+		STAT_INC(coalesces);
+		word* next_ptr = (word*)get_pointer(current);
+		ptr[0] += next_ptr[0];
+		ptr[1] = next_ptr[1];
+	}
+	if (prev != 0xFFFF)
 	{
-		word* cur_ptr=(word*)get_pointer(current);
-		while ((current + cur_ptr[0]) == cur_ptr[1]) // Consecutive blocks
+		word* prev_ptr = (word*)get_pointer(prev);
+		if ((prev + prev_ptr[0]) == offset)
 		{
-			word* next_ptr=(word*)get_pointer(cur_ptr[1]);
-			cur_ptr[0]+=next_ptr[0];
-			cur_ptr[1]=next_ptr[1];
+			STAT_INC(coalesces);
+			prev_ptr[0] += ptr[0];
+			prev_ptr[1] = ptr[1];
+			offset = prev;
+			ptr = prev_ptr;
+			prev = before;
 		}
-		current=cur_ptr[1];
 	}
-}
-
-void defrag()
-{
-	sort_free_blocks();
-	unite_free_blocks();
+	// prev is now the predecessor of the (possibly merged) block
+	if (prev == 0xFFFF) free_block = offset;
+	else ((word*)get_pointer(prev))[1] = offset;
+	if ((offset + ptr[0]) == heap)
+	{
+		heap = offset;
+		if (prev == 0xFFFF) free_block = ptr[1];
+		else ((word*)get_pointer(prev))[1] = ptr[1];
+	}
 }
 
 void	release(void* ptr)
 {
 	if (!ptr) return;
+	STAT_INC(release_calls);
 	word* header = (word*)ptr;
 	--header;
 #ifdef DEV
-	if (logfile)
-		fprintf(logfile,"R %hd %hd\n",header[0],get_offset(header));
+	trace_write(&alloc_trace, header[0] | TRACE_RELEASE, get_offset(header));
 #endif
 	word size=*header;
 	total_allocated -= size;
 	word offset = get_offset(header);
 	if ((offset + size) == heap)
-	{
 		heap -= size;
+	else if (size <= SMALL_LIMIT)
+		push_bin(offset, size);
+	else
+		insert_free_block(offset, size);
+}
+
+// The block stays in place.  The log records it as released and
+// allocated again at the same offset with the smaller size.  The rest goes
+// to the free list even when it is small, merging with a free block after
+// it, so the heap ends up as it would after that release and allocation
+void	shrink(void* ptr, word size)
+{
+	if (!ptr) return;
+	if (size<sizeof(word))
+		size=sizeof(word);
+	size += sizeof(word) + (size & 1);
+	word* header = (word*)ptr;
+	--header;
+	// The rest has to hold a free block header
+	if (header[0] < size + 2 * sizeof(word)) return;
+	word rest = header[0] - size;
+	word offset = get_offset(header);
+#ifdef DEV
+	trace_write(&alloc_trace, header[0] | TRACE_RELEASE, offset);
+	trace_write(&alloc_trace, size, offset);
+#endif
+	header[0] = size;
+	total_allocated -= rest;
+	insert_free_block(offset + size, rest);
+}
+
+// The space comes from the top of the heap or from a free block that starts
+// right after this one.  Logged like shrink
+byte	extend(void* ptr, word size)
+{
+	if (!ptr) return 0;
+	size += (size & 1);
+	word* header = (word*)ptr;
+	--header;
+	if (size > (0xFFFF - header[0])) return 0;
+	word offset = get_offset(header);
+	word end = offset + header[0];
+	if (end == heap)
+	{
+		if (!check_heap(size)) return 0;
+		heap += size;
 	}
 	else
 	{
-		header[1] = free_block;
-		free_block = offset;
-		defrag();
+		word prev = 0xFFFF;
+		word current = free_block;
+		while (current != 0xFFFF && current < end)
+		{
+			prev = current;
+			current = ((word*)get_pointer(current))[1];
+		}
+		if (current != end) return 0;
+		word* block = (word*)get_pointer(current);
+		word rest = block[0] - size;
+		if (block[0] < size || (rest > 0 && rest < (2 * sizeof(word)))) return 0;
+		word next = block[1];
+		if (rest > 0)
+		{
+			// The rest of the free block stays in the list, further up.
+			// Its header can overlap the old one
+			word* rest_ptr = (word*)get_pointer(end + size);
+			rest_ptr[1] = next;
+			rest_ptr[0] = rest;
+			next = end + size;
+		}
+		if (prev == 0xFFFF) free_block = next;
+		else ((word*)get_pointer(prev))[1] = next;
 	}
+#ifdef DEV
+	trace_write(&alloc_trace, header[0] | TRACE_RELEASE, offset);
+	trace_write(&alloc_trace, header[0] + size, offset);
+#endif
+	header[0] += size;
+	total_allocated += size;
+	if (total_allocated > max_allocated)
+		max_allocated = total_allocated;
+	return 1;
 }
 
 byte verify_heap()
@@ -216,6 +347,11 @@ byte verify_heap()
 		sum_free_blocks+=*block;
 		next_free_block=block[1];
 	}
+	for (word i = 0; i < BIN_COUNT; ++i)
+	{
+		for (word offset = bins[i]; offset != 0xFFFF; offset = ((word*)get_pointer(offset))[1])
+			sum_free_blocks += *(word*)get_pointer(offset);
+	}
 	return (total_allocated + sum_free_blocks == heap) ? 1 : 0;
 }
 
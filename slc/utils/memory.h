@@ -6,6 +6,10 @@ void		alloc_init();
 void		alloc_shut();
 void*		allocate(word size);
 void		release(void* ptr);
+// Keep the first size bytes of a block, giving the rest back to the heap
+void		shrink(void* ptr, word size);
+// Grow a block in place by size bytes.  Returns 0 if the memory after it is taken
+byte		extend(void* ptr, word size);
 unsigned	get_total_allocated();
 unsigned	get_max_allocated();
 void		print_leaked();
@@ -0,0 +1,89 @@
+#include "stats.h"
+
+#ifdef DEV
+#include <stdio.h>
+#include <time.h>
+#include "memory.h"
+
+#define MAX_NESTING 8
+
+Stats stats;
+
+static byte enabled = 0;
+static byte phases[MAX_NESTING];
+static byte depth = 0;
+static double last = 0.0;
+
+static const char* phase_names[PHASE_COUNT] = { "other", "lex", "parse", "codegen", "fixup", "optimize" };
+
+static double now()
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Charge the time since the last phase change to the current phase
+static void account()
+{
+	double t = now();
+	stats.seconds[depth ? phases[depth - 1] : PHASE_NONE] += t - last;
+	last = t;
+}
+
+// Timers are off until stats_start, counters always run
+void stats_start()
+{
+	enabled = 1;
+	depth = 0;
+	last = now();
+}
+
+void stats_enter(byte phase)
+{
+	if (!enabled) return;
+	account();
+	if (depth < MAX_NESTING) phases[depth] = phase;
+	++depth;
+}
+
+void stats_leave()
+{
+	if (!enabled || depth == 0) return;
+	account();
+	--depth;
+}
+
+byte stats_write(const char* filename)
+{
+	if (enabled) account();
+	FILE* f = fopen(filename, "w");
+	if (!f) return 0;
+	double total = 0.0;
+	fprintf(f, "{\n\t\"seconds\": {");
+	for (byte i = 0; i < PHASE_COUNT; ++i)
+	{
+		fprintf(f, "\"%s\": %.6f, ", phase_names[i], stats.seconds[i]);
+		total += stats.seconds[i];
+	}
+	fprintf(f, "\"total\": %.6f},\n", total);
+	fprintf(f, "\t\"lexer\": {\"tokens\": %lu},\n", stats.tokens);
+	fprintf(f, "\t\"parser\": {\"nodes_allocated\": %lu, \"nodes_freed\": %lu},\n",
+		stats.nodes_allocated, stats.nodes_freed);
+	fprintf(f, "\t\"heap\": {\"allocate\": %lu, \"release\": %lu, \"peak\": %u, \"leaked\": %u,\n",
+		stats.allocate_calls, stats.release_calls, get_max_allocated(), get_total_allocated());
+	fprintf(f, "\t\t\"free_list_searches\": %lu, \"free_list_steps\": %lu, \"free_list_max_steps\": %lu,\n",
+		stats.free_list_searches, stats.free_list_steps, stats.free_list_max_steps);
+	fprintf(f, "\t\t\"free_list_inserts\": %lu, \"free_list_insert_steps\": %lu, \"coalesces\": %lu, \"bin_splits\": %lu},\n",
+		stats.free_list_inserts, stats.free_list_insert_steps, stats.coalesces, stats.bin_splits);
+	fprintf(f, "\t\"strhash\": {\"lookups\": %lu, \"probes\": %lu, \"max_probes\": %lu, \"rehashes\": %lu},\n",
+		stats.strhash_lookups, stats.strhash_probes, stats.strhash_max_probes, stats.strhash_rehashes);
+	fprintf(f, "\t\"symtab\": {\"lookups\": %lu, \"probes\": %lu, \"max_probes\": %lu},\n",
+		stats.symtab_lookups, stats.symtab_probes, stats.symtab_max_probes);
+	fprintf(f, "\t\"output\": {\"writes\": %lu, \"bytes\": %lu, \"seeks\": %lu}\n}\n",
+		stats.output_writes, stats.output_bytes, stats.output_seeks);
+	fclose(f);
+	return 1;
+}
+
+#endif
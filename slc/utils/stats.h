@@ -0,0 +1,71 @@
+#pragma once
+
+#include "types.h"
+
+// Instrumentation for slc --stats.  Counters and phase timers only exist
+// in DEV builds, elsewhere the macros compile to nothing.
+
+#define PHASE_NONE		0
+#define PHASE_LEX		1
+#define PHASE_PARSE		2
+#define PHASE_CODEGEN	3
+#define PHASE_FIXUP		4
+#define PHASE_OPTIMIZE	5
+#define PHASE_COUNT		6
+
+#ifdef DEV
+
+typedef struct stats_
+{
+	double			seconds[PHASE_COUNT];	// Exclusive time per phase
+	unsigned long	tokens;
+	unsigned long	nodes_allocated;
+	unsigned long	nodes_freed;
+	unsigned long	allocate_calls;
+	unsigned long	release_calls;
+	unsigned long	free_list_searches;		// find_free_block calls
+	unsigned long	free_list_steps;		// Blocks visited by find_free_block
+	unsigned long	free_list_max_steps;
+	unsigned long	free_list_inserts;
+	unsigned long	free_list_insert_steps;
+	unsigned long	coalesces;				// Free blocks merged with a neighbour
+	unsigned long	bin_splits;
+	unsigned long	strhash_lookups;
+	unsigned long	strhash_probes;			// Slots passed over before a hit or a free slot
+	unsigned long	strhash_max_probes;
+	unsigned long	strhash_rehashes;
+	unsigned long	symtab_lookups;
+	unsigned long	symtab_probes;			// Same, for the symbol tables
+	unsigned long	symtab_max_probes;
+	unsigned long	output_writes;
+	unsigned long	output_bytes;
+	unsigned long	output_seeks;			// Writes that do not append
+} Stats;
+
+extern Stats stats;
+
+// Phase timers nest: time is charged to the innermost phase
+void stats_start();
+void stats_enter(byte phase);
+void stats_leave();
+byte stats_write(const char* filename);
+
+#define STAT_INC(field) (++stats.field)
+#define STAT_ADD(field, n) (stats.field += (n))
+#define STAT_MAX(field, n) do { if ((n) > stats.field) stats.field = (n); } while (0)
+#define STAT_LOCAL(name) unsigned long name = 0
+#define STAT_STEP(name) (++name)
+#define STATS_ENTER(phase) stats_enter(phase)
+#define STATS_LEAVE() stats_leave()
+
+#else
+
+#define STAT_INC(field)
+#define STAT_ADD(field, n)
+#define STAT_MAX(field, n)
+#define STAT_LOCAL(name)
+#define STAT_STEP(name)
+#define STATS_ENTER(phase)
+#define STATS_LEAVE()
+
+#endif
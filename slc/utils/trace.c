@@ -0,0 +1,63 @@
+#include "trace.h"
+
+#ifdef DEV
+#include <stdio.h>
+
+static byte enabled = 1;
+
+void trace_enable(byte on)
+{
+	enabled = on;
+}
+
+byte trace_open(Trace* t, const char* filename)
+{
+	t->used = 0;
+	t->file = 0;
+	if (!enabled)
+	{
+		remove(filename);
+		return 0;
+	}
+	t->file = fopen(filename, "wb");
+	return t->file != 0;
+}
+
+static void flush(Trace* t)
+{
+	fwrite(t->records, sizeof(t->records[0]), t->used, (FILE*)t->file);
+	t->used = 0;
+}
+
+void trace_write(Trace* t, word a, word b)
+{
+	if (!t->file) return;
+	t->records[t->used][0] = a;
+	t->records[t->used][1] = b;
+	if (++t->used == TRACE_BUFFER) flush(t);
+}
+
+void trace_close(Trace* t)
+{
+	if (!t->file) return;
+	flush(t);
+	fclose((FILE*)t->file);
+	t->file = 0;
+}
+
+byte trace_read(const char* filename, trace_record_func f, void* context)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file) return 0;
+	word records[TRACE_BUFFER][2];
+	size_t n;
+	while ((n = fread(records, sizeof(records[0]), TRACE_BUFFER, file)) > 0)
+	{
+		for (size_t i = 0; i < n; ++i)
+			f(records[i][0], records[i][1], context);
+	}
+	fclose(file);
+	return 1;
+}
+
+#endif
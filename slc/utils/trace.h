@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+// Binary traces written by DEV builds (alloc.log, line_offsets.log).
+// A trace is a stream of fixed records of two native endian words,
+// buffered and written in blocks.
+
+#define TRACE_BUFFER 256		// Records per write
+#define TRACE_RELEASE 0x8000	// alloc.log: set in the size of a release record
+
+typedef struct trace_
+{
+	void*	file;
+	word	used;
+	word	records[TRACE_BUFFER][2];
+} Trace;
+
+typedef void (*trace_record_func)(word a, word b, void* context);
+
+// Tracing is on by default.  When it is off, trace_open removes the file
+// left by an earlier run instead of creating a new one
+void trace_enable(byte enabled);
+
+// Returns 0 if tracing is disabled or the file cannot be created.
+// Writing to and closing a trace that is not open does nothing
+byte trace_open(Trace* t, const char* filename);
+void trace_write(Trace* t, word a, word b);
+void trace_close(Trace* t);
+
+// Calls f for every record.  Returns 0 if the file cannot be opened
+byte trace_read(const char* filename, trace_record_func f, void* context);